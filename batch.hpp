@@ -0,0 +1,347 @@
+//
+// batch.hpp
+// ~~~~~~~~~~~~~~~~~~~~~
+//
+// Copyright (c) 2004-2012 Metasystems Technologies Inc. (MTI)
+// All rights reserved
+//
+// Distributed under the MTI Software License, Version 0.1.
+//
+// as defined by accompanying file MTI-LICENSE-0.1.info or
+// at http://www.mtihq.com/license/MTI-LICENSE-0.1.info
+//
+
+#ifndef __BATCH_HPP
+#define __BATCH_HPP
+
+// c
+#include <stdint.h>
+#include <string.h>
+
+// c++
+#include <string>
+#include <vector>
+#include <algorithm>
+
+// boost
+#include <boost/shared_ptr.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/utility/string_ref.hpp>
+#include <boost/iterator/iterator_facade.hpp>
+
+// local
+
+//
+namespace mti { namespace audit { namespace shield {
+
+//
+namespace directory {
+
+//
+// The events of one notification, built once and then shared read-only by
+// every slot it is handed to ...
+//
+//  o> R    the stored record, fixed size, strings held as offsets (name)
+//  o> V    what iteration yields, built from the batch and a record
+//  o> F    the filter type, records refer to filters by index
+//
+// Every string lives in one arena and is interned, a name seen twice in a
+// batch is stored once. Each is kept as a 32 bit length, the bytes and a
+// terminating NUL, and referred to by the offset of its first byte (offset
+// 0 is the empty string). seal() orders the records by name and keeps the
+// first of each name, which is what the std::set of messages used to do;
+// left unordered, the records stay in the order they were pushed.
+//
+// Apart from the amortised growth of its three vectors (see reserve()) a
+// batch allocates nothing per record.
+//
+template <class R, class V, class F>
+class batch : private boost::noncopyable
+{
+    public:
+        //
+        typedef R                   record;
+        typedef V                   value_type;
+        typedef F                   filter_type;
+        typedef std::vector<R>      records;
+        typedef std::vector<F>      filters;
+
+        //
+        class const_iterator : public boost::iterator_facade<const_iterator, V, boost::random_access_traversal_tag, V>
+        {
+            public:
+                const_iterator() : owner_( NULL ), at_( 0 ) {}
+                const_iterator( batch const* b, size_t i ) : owner_( b ), at_( i ) {}
+
+            private:
+                friend class boost::iterator_core_access;
+
+                V dereference() const { return V( *owner_, owner_->rec_[ at_ ] ); }
+                bool equal( const_iterator const& i ) const { return at_ == i.at_; }
+                void increment() { ++at_; }
+                void decrement() { --at_; }
+                void advance( ptrdiff_t n ) { at_ += n; }
+                ptrdiff_t distance_to( const_iterator const& i ) const { return (ptrdiff_t)i.at_ - (ptrdiff_t)at_; }
+
+                batch const* owner_;
+                size_t       at_;
+        };
+
+        typedef const_iterator iterator;
+
+        //
+        batch() : used_( 0 ) { init(); }
+        batch( filters const& f ) : used_( 0 ), filter_( f ) { init(); }
+
+        //
+        // producer side, before seal()
+        //
+        uint32_t intern( const char* s, size_t n )
+        {
+            if ( n == 0 )
+                return 0;
+
+            if ( ( used_ + 1 ) * 2 > slot_.size() )
+                grow();
+
+            size_t h = hash( s, n ) & ( slot_.size() - 1 );
+
+            for ( ; slot_[ h ] != 0; h = ( h + 1 ) & ( slot_.size() - 1 ) )
+            {
+                uint32_t o = slot_[ h ];
+
+                if ( ( length( o ) == n ) && ( ::memcmp( &blob_[ o ], s, n ) == 0 ) )
+                    return o;
+            }
+
+            uint32_t l = (uint32_t)n;
+            uint32_t o = (uint32_t)( blob_.size() + sizeof( l ) );
+
+            blob_.insert( blob_.end(), (const char*)&l, (const char*)&l + sizeof( l ) );
+            blob_.insert( blob_.end(), s, s + n );
+            blob_.push_back( '\0' );
+
+            slot_[ h ] = o;
+            ++used_;
+
+            return o;
+        }
+
+        uint32_t intern( std::string const& s ) { return intern( s.data(), s.length() ); }
+        uint32_t intern( boost::string_ref s ) { return intern( s.data(), s.length() ); }
+
+        //
+        bool interned( const char* s, size_t n ) const
+        {
+            if ( n == 0 )
+                return true;
+
+            for ( size_t h = hash( s, n ) & ( slot_.size() - 1 ); slot_[ h ] != 0; h = ( h + 1 ) & ( slot_.size() - 1 ) )
+            {
+                if ( ( length( slot_[ h ] ) == n ) && ( ::memcmp( &blob_[ slot_[ h ] ], s, n ) == 0 ) )
+                    return true;
+            }
+
+            return false;
+        }
+
+        bool interned( std::string const& s ) const { return interned( s.data(), s.length() ); }
+
+        //
+        void reserve( size_t n, size_t bytes )
+        {
+            rec_.reserve( n );
+            blob_.reserve( bytes + n * ( sizeof( uint32_t ) + 1 ) );
+
+            while ( slot_.size() < n * 2 )
+                grow();
+        }
+
+        //
+        // Append the records of another batch, its strings interned here and
+        // its filters placed after these, unless the same filters are here
+        // already (batches of one query absorbed in turn). R keeps its strings
+        // in name and from, and its filter index in match.
+        //
+        void absorb( batch const& b )
+        {
+            uint32_t base = place( b.filter_ );
+
+            // absorbed into again and again while held, keep growth amortised
+            if ( rec_.capacity() < rec_.size() + b.rec_.size() )
+                rec_.reserve( std::max( rec_.capacity() * 2, rec_.size() + b.rec_.size() ) );
+
+            for ( size_t i = 0; i < b.rec_.size(); ++i )
+            {
+                R r = b.rec_[ i ];
+
+                r.name   = intern( b.text( r.name ) );
+                r.from   = intern( b.text( r.from ) );
+                r.match += base;
+
+                rec_.push_back( r );
+            }
+        }
+
+        //
+        void push( R const& r ) { rec_.push_back( r ); }
+        R& at( size_t i ) { return rec_[ i ]; }
+
+        //
+        void seal( bool order = true )
+        {
+            if ( ! order )
+                return;
+
+            std::stable_sort( rec_.begin(), rec_.end(), before( *this ) );
+            rec_.erase( std::unique( rec_.begin(), rec_.end(), same() ), rec_.end() );
+        }
+
+        //
+        void clear()
+        {
+            rec_.clear();
+            blob_.clear();
+            slot_.clear();
+            used_ = 0;
+
+            init();
+        }
+
+        //
+        // consumer side
+        //
+        size_t size() const { return rec_.size(); }
+        size_t bytes() const { return blob_.size(); }
+        bool empty() const { return rec_.empty(); }
+
+        const_iterator begin() const { return const_iterator( this, 0 ); }
+        const_iterator end() const { return const_iterator( this, rec_.size() ); }
+
+        V operator[]( size_t i ) const { return V( *this, rec_[ i ] ); }
+
+        //
+        boost::string_ref text( uint32_t o ) const
+        {
+            return ( o == 0 ) ? boost::string_ref( "", 0 ) : boost::string_ref( &blob_[ o ], length( o ) );
+        }
+
+        F const& match( size_t i ) const { return filter_[ i ]; }
+        records const& raw() const { return rec_; }
+
+    protected:
+    private:
+        //
+        struct before
+        {
+            before( batch const& b ) : b_( b ) {}
+            bool operator()( R const& x, R const& y ) const { return b_.text( x.name ) < b_.text( y.name ); }
+            batch const& b_;
+        };
+
+        //
+        struct same
+        {
+            bool operator()( R const& x, R const& y ) const { return x.name == y.name; }    // interned
+        };
+
+        //
+        void init()
+        {
+            slot_.assign( 64, 0 );
+        }
+
+        //
+        // Where these filters start among ours, appended when not found
+        //
+        uint32_t place( filters const& f )
+        {
+            for ( size_t at = 0; ( ! f.empty() ) && ( at + f.size() <= filter_.size() ); ++at )
+            {
+                if ( std::equal( f.begin(), f.end(), filter_.begin() + at ) )
+                    return (uint32_t)at;
+            }
+
+            uint32_t base = (uint32_t)filter_.size();
+
+            filter_.insert( filter_.end(), f.begin(), f.end() );
+            return base;
+        }
+
+        //
+        void grow()
+        {
+            std::vector<uint32_t> old;
+
+            old.swap( slot_ );
+            slot_.assign( old.size() * 2, 0 );
+
+            for ( size_t i = 0; i < old.size(); ++i )
+            {
+                if ( old[ i ] == 0 )
+                    continue;
+
+                size_t h = hash( &blob_[ old[ i ] ], length( old[ i ] ) ) & ( slot_.size() - 1 );
+
+                while ( slot_[ h ] != 0 )
+                    h = ( h + 1 ) & ( slot_.size() - 1 );
+
+                slot_[ h ] = old[ i ];
+            }
+        }
+
+        //
+        uint32_t length( uint32_t o ) const
+        {
+            uint32_t l;
+
+            ::memcpy( &l, &blob_[ o - sizeof( l ) ], sizeof( l ) );
+            return l;
+        }
+
+        //
+        static size_t hash( const char* s, size_t n )
+        {
+            size_t h = 14695981039346656037ULL;     // FNV-1a
+
+            for ( size_t i = 0; i < n; ++i )
+                h = ( h ^ (unsigned char)s[ i ] ) * 1099511628211ULL;
+
+            return h;
+        }
+
+        //
+        records               rec_;
+        std::vector<char>     blob_;    // interned strings
+        std::vector<uint32_t> slot_;    // open addressed, blob offsets
+        size_t                used_;
+        filters               filter_;
+};
+
+//
+// A shared batch held back by a dispatcher: each one that comes while it is
+// held is absorbed into it, and it is sealed once, to be queued. Sealed, it
+// keeps the first message of each name as a single batch does.
+//
+template <class B>
+void absorbed( boost::shared_ptr<B>& held, boost::shared_ptr<const B> const& newer )
+{
+    if ( ! held )
+        held.reset( new B() );
+
+    held->absorb( *newer );
+}
+
+//
+template <class B>
+boost::shared_ptr<const B> sealed( boost::shared_ptr<B>& held, bool order )
+{
+    held->seal( order );
+    return held;
+}
+
+}   // namespace mti::audit::shield::directory
+
+}}} // namespace mti::audit::shield
+
+#endif // __BATCH_HPP
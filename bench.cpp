@@ -0,0 +1,317 @@
+//
+#include <time.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+//
+#include <string>
+#include <vector>
+#include <iostream>
+
+//
+#include <boost/bind.hpp>
+#include <boost/regex.hpp>
+#include <boost/signals2.hpp>
+#include <boost/filesystem.hpp>
+
+//
+#include "scan.hpp"
+#include "match.hpp"
+#include "fanout.hpp"
+
+//
+using namespace mti::audit::shield::directory;
+
+//
+// Throughput of the pieces the monitors are built from, on a tree made up
+// for it: bench-dir [tree] [directories] [files per directory]. One file
+// in a hundred is a *.log. Numbers depend on the page cache being warm,
+// run it twice.
+//
+
+//
+static double now()
+{
+    struct timespec ts;
+
+    ::clock_gettime( CLOCK_MONOTONIC, &ts );
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+//
+static void report( std::string const& what, size_t n, double secs, const char* unit )
+{
+    char line[ 160 ];
+
+    ::snprintf( line, sizeof( line ), "  %-40s %12.0f %s/s", what.c_str(), n / secs, unit );
+    std::cout << line << std::endl;
+}
+
+//
+// dirs x files empty files, made once and kept for the next run
+//
+static void plant( std::string const& tree, size_t dirs, size_t files )
+{
+    char mark[ 64 ];
+
+    ::snprintf( mark, sizeof( mark ), "/.bench-%zu-%zu", dirs, files );
+
+    if ( boost::filesystem::exists( tree + mark ) )
+        return;
+
+    std::cout << "making " << dirs * files << " files below " << tree << std::endl;
+
+    boost::filesystem::remove_all( tree );
+    boost::filesystem::create_directories( tree );
+
+    for ( size_t d = 0; d < dirs; ++d )
+    {
+        char dir[ 32 ];
+
+        ::snprintf( dir, sizeof( dir ), "/d%04zu", d );
+        ::mkdir( ( tree + dir ).c_str(), 0755 );
+
+        for ( size_t f = 0; f < files; ++f )
+        {
+            char name[ 32 ];
+
+            ::snprintf( name, sizeof( name ), "/f%06zu.%s", f, ( f % 100 == 0 ) ? "log" : "dat" );
+
+            FILE* fp = ::fopen( ( tree + dir + name ).c_str(), "w" );
+
+            if ( fp )
+                ::fclose( fp );
+        }
+    }
+
+    FILE* fp = ::fopen( ( tree + mark ).c_str(), "w" );
+
+    if ( fp )
+        ::fclose( fp );
+}
+
+//
+// Counts what the scanner hands over
+//
+class counter : public scanner::visitor
+{
+    public:
+        counter( matcher const& m ) : match_( m ), found_( 0 ) {}
+
+        bool accept( std::string const& path, size_t /* depth */, size_t& /* tag */ )
+        {
+            return match_.matches( path );
+        }
+
+        void found( std::string const& /* path */, struct stat const& /* st */, size_t /* depth */, size_t /* tag */ )
+        {
+            found_++;
+        }
+
+        size_t found() const { return found_; }
+
+    private:
+        matcher const& match_;
+        size_t         found_;
+};
+
+//
+// What polling::list did before the scanner: a directory iterator, a type
+// test per entry and a stat for each name that matched
+//
+static size_t iterate( std::string const& tree, matcher const& m, size_t& seen )
+{
+    size_t      found = 0;
+    struct stat st;
+
+    seen = 0;
+
+    for ( boost::filesystem::recursive_directory_iterator i( tree ), end; i != end; ++i )
+    {
+        seen++;
+
+        if ( ( ! boost::filesystem::is_regular_file( i->status() ) ) || ( ! m.matches( i->path().string() ) ) )
+            continue;
+
+        if ( ::stat( i->path().c_str(), &st ) == 0 )
+            found++;
+    }
+
+    return found;
+}
+
+//
+static void scanning( std::string const& tree )
+{
+    const char* expr[] = { "*.log", "*" };
+
+    std::cout << "scanner (entries)" << std::endl;
+
+    for ( size_t e = 0; e < sizeof( expr ) / sizeof( expr[ 0 ] ); ++e )
+    {
+        matcher m( expr[ e ] );
+        size_t  seen;
+        double  t = now();
+
+        iterate( tree, m, seen );
+        report( std::string( "directory_iterator " ) + expr[ e ], seen, now() - t, "entries" );
+
+        scanner scan;
+        counter c( m );
+
+        t    = now();
+        seen = scan.scan( tree, true, c );
+        report( std::string( "scanner " ) + expr[ e ], seen, now() - t, "entries" );
+    }
+}
+
+//
+// Every name stat'd, through each backend in turn
+//
+static void fetching( std::string const& tree )
+{
+    const char*       name[] = { "sync", "pool", "uring" };
+    metadata::backend b[]    = { metadata::backend_sync, metadata::backend_pool, metadata::backend_uring };
+    matcher           all( "*" );
+
+    std::cout << "metadata (files)" << std::endl;
+
+    for ( size_t i = 0; i < sizeof( b ) / sizeof( b[ 0 ] ); ++i )
+    {
+        scanner scan( 0, metadata::create( b[ i ] ) );
+        counter c( all );
+        double  t = now();
+
+        scan.scan( tree, true, c );
+        report( name[ i ], c.found(), now() - t, "files" );
+    }
+}
+
+//
+// Filter cost per path: the regex built for every event, as the monitors
+// did before queries were compiled, against the compiled matcher
+//
+static void filtering()
+{
+    std::vector<std::string> path;
+    size_t                   hit = 0;
+
+    for ( size_t i = 0; i < 200000; ++i )
+    {
+        char name[ 64 ];
+
+        ::snprintf( name, sizeof( name ), "/var/log/app/d%04zu/f%06zu.%s", i / 1000, i, ( i % 100 == 0 ) ? "log" : "dat" );
+        path.push_back( name );
+    }
+
+    std::cout << "filter (paths)" << std::endl;
+
+    double t = now();
+
+    for ( size_t i = 0; i < path.size(); ++i )
+    {
+        boost::regex glob( "\\.log$" );
+
+        if ( boost::regex_search( path[ i ], glob ) )
+            hit++;
+    }
+
+    report( "regex per path", path.size(), now() - t, "paths" );
+
+    const char*     expr[]   = { "*.log", "\\.log$" };
+    matcher::syntax syntax[] = { matcher::syntax_glob, matcher::syntax_regex };
+
+    for ( size_t e = 0; e < sizeof( expr ) / sizeof( expr[ 0 ] ); ++e )
+    {
+        matcher m( expr[ e ], syntax[ e ] );
+
+        t = now();
+
+        for ( size_t i = 0; i < path.size(); ++i )
+            if ( m.matches( path[ i ] ) )
+                hit++;
+
+        report( std::string( "matcher " ) + expr[ e ], path.size(), now() - t, "paths" );
+    }
+
+    if ( hit != 3 * path.size() / 100 )
+        std::cout << "  filter mismatch: " << hit << std::endl;
+}
+
+//
+// A slot as cheap as a handler can be, so the emit is what gets measured
+//
+struct note
+{
+    std::string name;
+};
+
+//
+static void take( note const& n, size_t* seen )
+{
+    (*seen) += n.name.size();
+}
+
+//
+template <class S>
+static void emitting( const char* what, size_t slots )
+{
+    S      sig;
+    note   n;
+    size_t seen = 0;
+    size_t emits = 2000000 / slots;
+
+    n.name = "/var/log/app/f000000.log";
+
+    for ( size_t i = 0; i < slots; ++i )
+        sig.connect( boost::bind( &take, _1, &seen ) );
+
+    double t = now();
+
+    for ( size_t i = 0; i < emits; ++i )
+        sig( n );
+
+    t = now() - t;
+
+    char line[ 160 ];
+
+    ::snprintf( line, sizeof( line ), "  %-40s %12.0f ns/emit", what, t * 1e9 / emits );
+    std::cout << line << std::endl;
+
+    if ( seen != emits * slots * n.name.size() )
+        std::cout << "  fanout mismatch: " << seen << std::endl;
+}
+
+//
+// fanout against boost::signals2 for the slot counts a monitor sees
+//
+static void fanning()
+{
+    std::cout << "emit (1 / 10 / 100 slots)" << std::endl;
+
+    emitting< fanout<note const&> >( "fanout 1", 1 );
+    emitting< fanout<note const&> >( "fanout 10", 10 );
+    emitting< fanout<note const&> >( "fanout 100", 100 );
+    emitting< boost::signals2::signal<void (note const&)> >( "signals2 1", 1 );
+    emitting< boost::signals2::signal<void (note const&)> >( "signals2 10", 10 );
+    emitting< boost::signals2::signal<void (note const&)> >( "signals2 100", 100 );
+}
+
+//
+int main( int argc, char* argv[] )
+{
+    std::string tree  = ( argc > 1 ) ? argv[ 1 ] : "/tmp/bench-dir";
+    size_t      dirs  = ( argc > 2 ) ? ::atoi( argv[ 2 ] ) : 100;
+    size_t      files = ( argc > 3 ) ? ::atoi( argv[ 3 ] ) : 1000;
+
+    plant( tree, dirs, files );
+    scanning( tree );
+    fetching( tree );
+    filtering();
+    fanning();
+
+    return 0;
+}
@@ -12,13 +12,21 @@
 //
 
 // c
+#include <fcntl.h>
+#include <errno.h>
+#include <dirent.h>
+#include <limits.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 
 // c++
+#include <algorithm>
 #include <stdexcept>
 
 // boost
-#include <boost/regex.hpp>
 #include <boost/filesystem.hpp> 
+#include <boost/functional/hash.hpp>
 
 // local
 #include "dir.hpp"
@@ -28,8 +36,44 @@
 #define INVALID_HANDLE  -1
 #endif
 
+// largest single event the kernel can return
+#define MONITOR_EVENT   ( sizeof( struct inotify_event ) + NAME_MAX + 1 )
+
 #ifndef MONITOR_BUFFER
-#define MONITOR_BUFFER  ( ( sizeof( struct inotify_event ) + FILENAME_MAX ) * 1024 )
+#define MONITOR_BUFFER  ( MONITOR_EVENT * 256 )
+#endif
+
+#ifdef  IN_MASK_CREATE
+#define MONITOR_MASK_CREATE IN_MASK_CREATE
+#else
+#define MONITOR_MASK_CREATE IN_MASK_ADD
+#endif
+
+// what the directories below a recursive query are watched for
+#define MONITOR_TREE    ( IN_CREATE | IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF )
+
+// what a directory is watched for to keep its entries known (resync)
+#define MONITOR_NAMES   ( IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO )
+
+// a query watching for these anyway is resynced without options::resync
+#define MONITOR_CHURN   ( IN_CREATE | IN_DELETE )
+
+// timer wheel ticks per settle period
+#ifndef MONITOR_SETTLE_TICKS
+#define MONITOR_SETTLE_TICKS    8
+#endif
+
+#ifndef MONITOR_EPOLL
+#define MONITOR_EPOLL   8
+#endif
+
+// polling timer wheel, milliseconds per tick and ticks per turn
+#ifndef POLLING_TICK
+#define POLLING_TICK    5
+#endif
+
+#ifndef POLLING_SLOTS
+#define POLLING_SLOTS   1024
 #endif
 
 //
@@ -38,59 +82,184 @@ namespace mti { namespace audit { namespace shield {
 //
 namespace directory {
 
+//
+static uint64_t monotonic()
+{
+    struct timespec ts;
+
+    ::clock_gettime( CLOCK_MONOTONIC, &ts );
+
+    return ( (uint64_t)ts.tv_sec * 1000 ) + ( ts.tv_nsec / 1000000 );
+}
+
+//
+// An entry name's share of its directory's sum (FNV-1a), sums are taken
+// modulo 2^64 so entries can be added and taken out in any order
+//
+static uint64_t tally( const char* name )
+{
+    uint64_t h = 14695981039346656037ULL;
+
+    while ( *name )
+        h = ( h ^ (unsigned char)*name++ ) * 1099511628211ULL;
+
+    return h;
+}
+
+//
+// Whether a watch keeps its entries known, and so is resynced after an
+// overflow
+//
+static bool resynced( uint32_t mask )
+{
+    return ( ( mask & MONITOR_NAMES ) == MONITOR_NAMES );
+}
+
+//
+static bool since( struct timespec const& t, struct timespec const& at )
+{
+    return ( t.tv_sec > at.tv_sec ) || ( ( t.tv_sec == at.tv_sec ) && ( t.tv_nsec >= at.tv_nsec ) );
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 //
 // class monitor
 //
 ////////////////////////////////////////////////////////////////////////////////
 
-monitor::monitor()
+monitor::monitor( monitor::options opt /*= monitor::options()*/ )
     : run_( false ),
-      fd_( NONE )
+      opt_( opt ),
+      send_( opt_.queue,
+             boost::bind( &monitor::deliver, this, _1 ),
+             boost::bind( &absorbed<messages>, _1, _2 ),
+             boost::bind( &sealed<messages>, _1, opt_.order ) ),
+      meter_( "monitor" )
 {
+    meter_.queue = boost::bind( &monitor::queued, this );
 }
 
 //
-monitor::monitor( const monitor::slot_t& handler )
+monitor::monitor( const monitor::slot_t& handler, monitor::options opt /*= monitor::options()*/ )
     : run_( false ),
-      fd_( NONE )
+      opt_( opt ),
+      send_( opt_.queue,
+             boost::bind( &monitor::deliver, this, _1 ),
+             boost::bind( &absorbed<messages>, _1, _2 ),
+             boost::bind( &sealed<messages>, _1, opt_.order ) ),
+      meter_( "monitor" )
 {
+    meter_.queue = boost::bind( &monitor::queued, this );
     con_ = sig_.connect( handler );
 }
 
 //
 monitor::~monitor()
 {
+    if ( run_ )
+        stop();
+
     con_.disconnect();
 }
 
 //
 void monitor::add_directory( std::string dir, monitor::filter match /*= monitor::filter()*/ )
 {
-    boost::mutex::scoped_lock lock( mutex_ );
+    boost::unique_lock<boost::shared_mutex> lock( mutex_ );
 
     if ( ! boost::filesystem::is_directory( dir ) ) 
         throw std::invalid_argument( "monitor::add_directory: " + dir + " is not a valid directory entry" ); 
 
-    query_.insert( query( dir, match ) );
+    query              q( dir );
+    queryset::iterator i = query_.find( q );
+
+    // filters accumulate on a directory
+    if ( i != query_.end() )
+        q = (*i);
+
+    q.add( match );
+    q.real = boost::filesystem::canonical( dir ).string();
+
+    if ( ! q.meter )
+        q.meter = meter_.add( dir );
+
+    query_.erase( q );
+    query_.insert( q );
+
+    // already running, register the watch right away
+    if ( ! reactor_.empty() )
+        add_watch( shard( dir ), q );
 }
 
 //
 void monitor::del_directory( std::string dir )
 {
-    boost::mutex::scoped_lock lock( mutex_ );
+    boost::unique_lock<boost::shared_mutex> lock( mutex_ );
     query_.erase( query( dir ) );
+    meter_.del( dir );
+
+    if ( ! reactor_.empty() )
+        del_watch( shard( dir ), dir );
+}
+
+//
+void monitor::del_directory( std::string dir, std::string name )
+{
+    boost::unique_lock<boost::shared_mutex> lock( mutex_ );
+
+    queryset::iterator i = query_.find( query( dir ) );
+
+    if ( i == query_.end() )
+        return;
+
+    query q = (*i);
+
+    if ( ! q.del( name ) )
+        return;
+
+    query_.erase( i );
+
+    if ( q.match.size() > 0 )
+    {
+        query_.insert( q );
+
+        if ( ! reactor_.empty() )
+            add_watch( shard( dir ), q );
+
+        return;
+    }
+
+    meter_.del( dir );
+
+    if ( ! reactor_.empty() )
+        del_watch( shard( dir ), dir );
 }
 
 //
 void monitor::start()
 {
+    if ( ! connected() )
+        throw std::runtime_error( "Signal slot not set" );
+
+    //
+    init();
+
+    {
+        boost::unique_lock<boost::shared_mutex> lock( mutex_ );
+
+        for ( monitor::queryset::iterator q = query_.begin(); q != query_.end(); ++q )
+            add_watch( shard( (*q).path ), *q );
+    }
+
+    //
     run_ = true;
 
-    for ( monitor::queryset::iterator q = query_.begin(); q != query_.end(); ++q )
+    send_.start();
+
+    for ( monitor::reactors::iterator r = reactor_.begin(); r != reactor_.end(); ++r )
         pool_.create_thread( boost::bind( &monitor::work, 
                                           this, 
-                                          *q ) );
+                                          *r ) );
 }
 
 //
@@ -98,20 +267,13 @@ void monitor::stop()
 {
     run_ = false;
 
-    if ( fd_ != NONE )
-    {
-        boost::mutex::scoped_lock lock( mutex_ );
-
-        // stop inotify_read()
-        for ( std::vector<HANDLE>::iterator wd = wd_.begin(); wd != wd_.end(); ++wd )
-            ::inotify_rm_watch( fd_, *wd );
-
-        wd_.clear();
-        ::close( fd_ );
-    }
-
+    wake();
     interrupt();
     join();
+    close();
+
+    // what the reactors queued still goes out
+    send_.stop();
 }
 
 //
@@ -124,6 +286,7 @@ monitor::connection monitor::connect( const monitor::slot_t& handler )
 void monitor::interrupt()
 {
     pool_.interrupt_all();
+    wake();
 }
 
 //
@@ -133,85 +296,49 @@ void monitor::join()
 }
 
 //
-void monitor::work( monitor::query& dir )
+void monitor::work( monitor::reactor_ptr r )
 {
     try
     {
-        //
-        if ( connected() )
+        struct epoll_event ev[ MONITOR_EPOLL ];
+
+        while ( run_ )
         {
-            //
-            messages msg;
-    
-            //
-            init();
-    
-            while ( run_ )
+            int n = ::epoll_wait( r->ep, ev, MONITOR_EPOLL, timeout( r ) );
+
+            if ( n < 0 )
             {
-                HANDLE wd;
+                if ( errno == EINTR )
+                    continue;
+
+                throw std::runtime_error( "Could not wait on notification monitor" );
+            }
 
-                //
-                msg.clear();
-    
-                //
-                if ( ( wd = ::inotify_add_watch( fd_, dir.path.c_str(), (uint32_t)(dir.match.event) ) ) >= 0 )
+            //
+            boost::this_thread::interruption_point();
+
+            for ( int e = 0; ( e < n ) && ( run_ ); ++e )
+            {
+                if ( ev[ e ].data.fd == r->fd )
+                    read( r );
+                else
                 {
-                    {
-                        boost::mutex::scoped_lock lock( mutex_ );
-                        wd_.push_back( wd );
-                    }
-
-                    size_t len, i = 0;
-                    char buff[ MONITOR_BUFFER ] = {0};
-    
-                    //
-                    len = ::read( fd_, buff, MONITOR_BUFFER );
-    
-                    //
-                    i = 0;
-                    while ( ( i < len ) && ( run_ ) )
-                    {
-                        struct inotify_event *pevent = ( struct inotify_event*)&buff[ i ];
-    
-                        //
-                        if ( pevent->mask & (dir.match.event) )
-                        {
-                            try
-                            {
-                                message m;
-    
-                                m.name = boost::filesystem::canonical( dir.path + "/" + pevent->name ).c_str();
-                                m.match = dir.match;
-    
-                                if ( matches( m ) )
-                                    msg.insert( m ); // msg.push_back( m );
-                            }
-                            catch ( boost::filesystem::filesystem_error& err )
-                            {
-                                // do nothing ... except ignore
-                            }
-    
-                            //
-                            i += sizeof( struct inotify_event ) + pevent->len;
-    
-                            //
-                            boost::this_thread::yield();
-                        }
-                    }
+                    uint64_t val;
+
+                    // drain the wake-up counter, run_ is checked by the loop
+                    if ( ::read( r->ev, &val, sizeof( val ) ) < 0 )
+                        continue;
                 }
-                else
-                    throw std::runtime_error( "Could not add notification monitor" );
-    
-                //
-                if ( ( msg.size() > 0 ) && ( connected() ) )
-                    sig_( msg );
-
-                //
-                boost::this_thread::yield();
             }
+
+            //
+            settled( r );
+            unpaired( r );
+            flush( r, false );
         }
-        else
-            throw std::runtime_error( "Signal slot not set" );
+
+        // stopping, send whatever is still held back
+        flush( r, true );
     }
     catch ( boost::thread_interrupted const& )
     {
@@ -220,267 +347,2108 @@ void monitor::work( monitor::query& dir )
 }
 
 //
-void monitor::init()
+void monitor::read( monitor::reactor_ptr r )
 {
-    boost::mutex::scoped_lock lock( mutex_ );
+    ssize_t len;
 
-    if ( fd_ == NONE )
+    // drain the descriptor, it is non-blocking so this ends on EAGAIN ... or
+    // once something held is overdue, a steady stream never runs dry
+    while ( ( run_ ) && ( r->due >= monotonic() ) )
     {
-        if ( ( fd_ = ::inotify_init() ) == INVALID_HANDLE )
-            throw std::runtime_error( "Invalid notify file destriptor handle" );
+        if ( ( len = ::read( r->fd, r->buff.get(), r->size ) ) < 0 )
+        {
+            if ( errno == EINTR )
+                continue;
+
+            // anything lost to an overflow from here on changes ctime later
+            if ( errno == EAGAIN )
+                ::clock_gettime( CLOCK_REALTIME_COARSE, &r->drained );
+
+            break;
+        }
+
+        if ( len == 0 )
+            break;
+
+        meter_.read( len );
+
+        // the queries are only read here, the reactors share them; the
+        // watches are this reactor's own, add/del_directory() may change them
+        boost::shared_lock<boost::shared_mutex> share( mutex_ );
+        boost::mutex::scoped_lock               lock( r->lock );
+
+        ssize_t i = 0;
+
+        while ( ( i < len ) && ( run_ ) )
+        {
+            struct inotify_event *pevent = ( struct inotify_event*)&r->buff[ i ];
+            registry::iterator w = r->watch.find( pevent->wd );
+
+            //
+            i += sizeof( struct inotify_event ) + pevent->len;
+
+            // the queue was full and events were dropped, no watch to speak of
+            if ( pevent->mask & IN_Q_OVERFLOW )
+            {
+                metrics::count( meter_.all.overflows );
+                resync( r );
+
+                continue;
+            }
+
+            //
+            if ( w == r->watch.end() )
+                continue;
+
+            // the kernel dropped the watch (directory removed or unmounted)
+            if ( pevent->mask & IN_IGNORED )
+            {
+                ignored( r, pevent->wd );
+                continue;
+            }
+
+            const char* name = ( pevent->len > 0 ) ? pevent->name : NULL;
+
+            if ( ( name ) && ( resynced( w->second.mask ) ) )
+            {
+                if ( pevent->mask & ( IN_CREATE | IN_MOVED_TO ) )
+                {
+                    w->second.count++;
+                    w->second.sum += tally( name );
+                }
+                else if ( pevent->mask & ( IN_DELETE | IN_MOVED_FROM ) )
+                {
+                    w->second.count--;
+                    w->second.sum -= tally( name );
+                }
+            }
+
+            route( r, pevent->wd, pevent->mask, pevent->cookie, name );
+
+            // keep the watched tree in step below recursive queries
+            if ( ( name ) && ( pevent->mask & IN_ISDIR ) && ( rooted( r, pevent->wd ) ) )
+            {
+                if ( pevent->mask & ( IN_CREATE | IN_MOVED_TO ) )
+                    grow( r, pevent->wd, name );
+                else if ( pevent->mask & IN_MOVED_FROM )
+                {
+                    branches::iterator b = r->tree.find( branch( pevent->wd, name ) );
+
+                    if ( b != r->tree.end() )
+                        prune( r, b->second );
+                }
+            }
+            else if ( ( pevent->mask & IN_DELETE_SELF ) && ( w->second.parent != INVALID_HANDLE ) )
+                prune( r, pevent->wd );
+        }
     }
 }
 
 //
-bool monitor::matches( monitor::message& m )
+// Hand the event to every query it concerns: those of its own directory,
+// then, walking up, the recursive ones of each directory above. Called with
+// the reactor's lock held.
+//
+void monitor::route( monitor::reactor_ptr r, HANDLE wd, uint32_t mask, uint32_t cookie, const char* name )
 {
-    bool ok = false;
+    std::string rel;
+    bool        nested = false;
+    HANDLE      at     = INVALID_HANDLE;    // the event's own directory, if open
 
-    if ( ::stat( m.name.c_str(), &( m.stat ) ) == 0 )
+    while ( wd != INVALID_HANDLE )
     {
-        boost::regex glob( m.match.regex );
+        registry::iterator w = r->watch.find( wd );
+
+        if ( w == r->watch.end() )
+            return;
 
-        if ( m.match.regex.length() > 0 )
+        if ( ! nested )
+            at = w->second.dir;
+
+        for ( queryset::iterator q = w->second.query.begin(); q != w->second.query.end(); ++q )
         {
-            boost::regex glob( m.match.regex );
+            if ( ( ( nested ) && ( ! (*q).recur ) ) || ( ! ( mask & (*q).mask ) ) )
+                continue;
 
-            if( boost::regex_search( m.name, glob ) )
-                ok = true;
+            event( r, *q, rel.empty() ? (*q).real : (*q).real + "/" + rel, mask, cookie, name, nested, at );
         }
-        else
-            ok = true;
-    }
 
-    return ok;
-}
+        // the directory itself, the one above has the same event by name
+        if ( ! name )
+            return;
 
-//
-bool monitor::expired( time_t tm, int sec )
-{
-    return ( tm > 0 ) ? ( ::difftime( ::time( NULL ), tm ) >= sec ) : false;
+        rel    = rel.empty() ? w->second.name : w->second.name + "/" + rel;
+        wd     = w->second.parent;
+        nested = true;
+    }
 }
 
 //
-bool monitor::connected()
+// One event for one query, dir is where it happened (the query's directory
+// or one below it)
+//
+void monitor::event( monitor::reactor_ptr r, monitor::query const& q, std::string const& dir, uint32_t mask, uint32_t cookie, const char* name, bool nested, HANDLE at )
 {
-    return ( ! sig_.empty() );
-}
+    // moves are paired by cookie, the old name is gone
+    if ( ( mask & IN_MOVE ) && ( name ) )
+    {
+        moved( r, q, dir, mask, cookie, name, nested, at );
+        return;
+    }
 
-////////////////////////////////////////////////////////////////////////////////
-//
-// class polling
-//
-////////////////////////////////////////////////////////////////////////////////
+    record      m;
+    std::string path = ( name ) ? dir + "/" + name : dir;
 
-polling::polling()
-    : run_( false )
-{
-}
+    if ( ! matches( m, path, q, mask, r->state, nested, at, name ) )
+        return;
 
-//
-polling::polling( const polling::slot_t& handler )
-    : run_( false )
-{
-    con_ = sig_.connect( handler );
+    if ( opt_.settle > 0 )
+        settle( r, q, path, m );
+    else
+        keep( r, q, path, m );
 }
 
 //
-polling::~polling()
-{
-    con_.disconnect();
-}
-
+// Hold the message back in its query's batch, merged into the message
+// already there for the same name. Only the reactor's own thread holds
+// batches back.
 //
-void polling::add_directory( std::string dir, polling::filter match /*= polling::filter()*/, size_t ms /*= 0*/ )
+void monitor::keep( monitor::reactor_ptr r, monitor::query const& q, std::string const& name, monitor::record& m, std::string const& from /*= std::string()*/ )
 {
-    boost::mutex::scoped_lock lock( mutex_ );
+    hold& h = r->held[ q.path ];
 
-    if ( ! boost::filesystem::is_directory( dir ) ) 
-        throw std::invalid_argument( "polling::add_directory: " + dir + " is not a valid directory entry" ); 
+    if ( ! h.msg )
+    {
+        h.msg.reset( new messages( q.match ) );
+        h.at.clear();
+        h.due = monotonic() + opt_.window;
+    }
 
-    query_.insert( query( dir, match, ms ) );
-}
+    m.name = h.msg->intern( name );
+    m.from = h.msg->intern( from );
 
-//
-void polling::del_directory( std::string dir )
-{
-    boost::mutex::scoped_lock lock( mutex_ );
-    query_.erase( query( dir ) );
-}
+    boost::unordered_map<uint32_t, size_t>::iterator i = h.at.find( m.name );
 
-//
-void polling::start()
-{
-    run_ = true;
+    if ( i == h.at.end() )
+    {
+        h.at[ m.name ] = h.msg->size();
+        h.msg->push( m );
+    }
+    else
+    {
+        record& o = h.msg->at( i->second );
 
-    for ( polling::queryset::iterator q = query_.begin(); q != query_.end(); ++q )
-        pool_.create_thread( boost::bind( &polling::work, 
-                                          this, 
-                                          *q ) );
-}
+        o.event = (events)( o.event | m.event );
+        o.from  = ( m.from != 0 ) ? m.from : o.from;
+        o.ino   = m.ino;
+        o.size  = m.size;
+        o.mtime = m.mtime;
+    }
 
-//
-void polling::stop()
-{
-    run_ = false;
-    interrupt();
-    join();
-}
+    // full, goes out with the next flush
+    if ( ( opt_.limit > 0 ) && ( h.msg->size() >= opt_.limit ) )
+        h.due = 0;
 
-//
-void polling::interrupt()
-{
-    pool_.interrupt_all();
+    r->due = std::min( r->due, h.due );
 }
 
 //
-void polling::join()
-{
-    pool_.join_all();
-}
-
-
+// Send the batches that are due (or all of them), each sealed and shared
+// by every slot
 //
-polling::connection polling::connect( const polling::slot_t& handler )
+void monitor::flush( monitor::reactor_ptr r, bool all )
 {
-    return ( con_ = sig_.connect( handler ) );
-}
+    uint64_t now = monotonic();
 
-//
-void polling::work( polling::query& qry )
-{
-    try
+    r->due = UINT64_MAX;
+
+    for ( holding::iterator h = r->held.begin(); h != r->held.end(); )
     {
-        //
-        messages msg;
-    
-        while ( run_ )
+        if ( ( ! all ) && ( h->second.due > now ) )
         {
-            //
-            msg.clear();
-    
-            //
-            wait( qry.wait );
-            list( qry, msg );
-    
-            //
-            if ( ( msg.size() ) && ( connected() ) )
-                sig_( msg );
+            r->due = std::min( r->due, h->second.due );
+            ++h;
 
-            //
-            boost::thread::yield();
+            continue;
         }
-    }
-    catch ( boost::thread_interrupted const& )
-    {
-        // interuption is expected, so do nothing
+
+        boost::shared_ptr<messages> msg( h->second.msg );
+
+        r->held.erase( h++ );
+        msg->seal( opt_.order );
+
+        if ( connected() )
+            send_.push( messages_ptr( msg ) );
     }
 }
 
 //
-void polling::list( query dir, messages& msg )
+// One half of a move. The moved-from is kept by its cookie, once for each
+// query that saw it; the moved-to of the same query finds it and the two
+// are sent as one renamed message carrying both names. A moved-to without
+// its query's half came from a place that query does not watch and is sent
+// as created, or as renamed when another query saw it leave. Called with
+// the reactor's lock held.
+//
+void monitor::moved( monitor::reactor_ptr r, monitor::query const& q, std::string const& dir, uint32_t mask, uint32_t cookie, const char* base, bool nested, HANDLE at )
 {
-    if ( dir.match.recur )
+    record      m;
+    std::string name = dir + "/" + base;
+    bool        hit  = matches( m, name, q, mask, r->state, nested, at, base );
+
+    if ( mask & IN_MOVED_FROM )
     {
-        boost::filesystem::recursive_directory_iterator path( dir.path ), end;
+        std::pair<moving::iterator, bool> v = r->moves.insert( std::make_pair( cookie, move() ) );
+        half&                             h = v.first->second.from[ q.path ];
 
-        while ( path != end )
-        {
-            if ( boost::filesystem::exists( *path ) )
-            {
-                if ( boost::filesystem::is_regular_file( *path ) )
-                {
-                    message m;
+        if ( v.second )
+            v.first->second.due = monotonic() + opt_.moves;
 
-                    m.name = boost::filesystem::canonical( ( *path ).path().c_str() ).c_str();
-                    m.match = dir.match;
+        h.name = name;
+        h.msg  = m;
+        h.hit  = hit;
 
-                    if ( matches( m ) )
-                         msg.insert( m );
-                }
-            }
+        return;
+    }
 
-            try
-            {
-                ++path;
-            }
-            catch ( const boost::filesystem::filesystem_error )
-            {
-                continue;
-            }
+    //
+    moving::iterator v = r->moves.find( cookie );
 
-            //
-            boost::this_thread::yield();
+    if ( v == r->moves.end() )
+    {
+        if ( hit )
+        {
+            m.event = event_create;
+            keep( r, q, name, m );
         }
+
+        return;
     }
-    else
-    {
-        boost::filesystem::directory_iterator path( dir.path ), end;
 
-        while ( path != end )
+    halves::iterator h = v->second.from.find( q.path );
+
+    if ( h == v->second.from.end() )
+    {
+        // moved in from another query's directory
+        if ( hit )
         {
-            if ( boost::filesystem::exists( *path ) )
+            m.event = event_renamed;
+            keep( r, q, name, m, v->second.from.begin()->second.name );
+        }
+
+        return;
+    }
+
+    if ( hit )
+    {
+        m.event = event_renamed;
+        keep( r, q, name, m, h->second.name );
+    }
+    else if ( ( h->second.hit ) && ( h->second.msg.match < q.match.size() ) )
+    {
+        // only the old name matched
+        record      n( h->second.msg );
+        struct stat buf;
+
+        if ( ( ! q.match[ n.match ].meta ) || ( ::stat( name.c_str(), &buf ) == 0 ) )
+        {
+            if ( q.match[ n.match ].meta )
+            {
+                n.ino   = buf.st_ino;
+                n.size  = buf.st_size;
+                n.mtime = buf.st_mtim;
+            }
+
+            n.event = event_renamed;
+            keep( r, q, name, n, h->second.name );
+        }
+    }
+
+    // paired, the other queries' halves still wait for theirs
+    v->second.from.erase( h );
+
+    if ( v->second.from.empty() )
+        r->moves.erase( v );
+}
+
+//
+// Moved-from halves that waited long enough, the file went somewhere their
+// query does not watch and is sent to it as deleted
+//
+void monitor::unpaired( monitor::reactor_ptr r )
+{
+    if ( r->moves.empty() )
+        return;
+
+    uint64_t                                now = monotonic();
+    boost::shared_lock<boost::shared_mutex> lock( mutex_ );
+
+    for ( moving::iterator v = r->moves.begin(); v != r->moves.end(); )
+    {
+        if ( v->second.due > now )
+        {
+            ++v;
+            continue;
+        }
+
+        for ( halves::iterator h = v->second.from.begin(); h != v->second.from.end(); ++h )
+        {
+            queryset::iterator q;
+
+            if ( ( ! h->second.hit ) || ( ( q = query_.find( query( h->first ) ) ) == query_.end() ) )
+                continue;
+
+            record m( h->second.msg );
+
+            m.event = event_deleted;
+            keep( r, *q, h->second.name, m );
+        }
+
+        r->moves.erase( v++ );
+    }
+}
+
+//
+// Settle mode, the file's events are merged until it has been quiet long
+// enough. Its timer is set once, settled() sets it again while the file
+// is still being written. Only the reactor's own thread settles files.
+//
+void monitor::settle( monitor::reactor_ptr r, monitor::query const& q, std::string const& name, monitor::record& m )
+{
+    uint64_t                              now = monotonic();
+    std::pair<pending::iterator, bool>    p   = r->quiet.insert( std::make_pair( pendkey( q.path, name ), pend() ) );
+    pend&                                 f   = p.first->second;
+
+    if ( p.second )
+    {
+        f.msg = m;
+        r->timer.add( now + opt_.settle, p.first );
+    }
+    else
+    {
+        f.msg.event = (events)( f.msg.event | m.event );
+        f.msg.ino   = m.ino;
+        f.msg.size  = m.size;
+        f.msg.mtime = m.mtime;
+    }
+
+    f.last = now;
+}
+
+//
+// Hand the files that have gone quiet on to be sent, those written to
+// since their timer was set wait another period
+//
+void monitor::settled( monitor::reactor_ptr r )
+{
+    std::vector<pending::iterator> due;
+    uint64_t                       now = monotonic();
+
+    r->timer.expire( now, due );
+
+    if ( due.empty() )
+        return;
+
+    boost::shared_lock<boost::shared_mutex> lock( mutex_ );
+
+    for ( std::vector<pending::iterator>::iterator p = due.begin(); p != due.end(); ++p )
+    {
+        pend&              f = (*p)->second;
+        queryset::iterator q;
+        struct stat        buf;
+
+        if ( f.last + opt_.settle > now )
+        {
+            r->timer.add( f.last + opt_.settle, *p );
+            continue;
+        }
+
+        // the directory may no longer be watched, or the file gone
+        if ( ( ( q = query_.find( query( (*p)->first.first ) ) ) != query_.end() ) &&
+             ( f.msg.match < (*q).match.size() ) &&
+             ( ::stat( (*p)->first.second.c_str(), &buf ) == 0 ) )
+        {
+            f.msg.ino   = buf.st_ino;
+            f.msg.size  = buf.st_size;
+            f.msg.mtime = buf.st_mtim;
+
+            keep( r, *q, (*p)->first.second, f.msg );
+        }
+
+        r->quiet.erase( *p );
+    }
+}
+
+//
+// Milliseconds until the first held batch or unpaired move is due, or the
+// settle timers tick, -1 (block) when nothing is waiting
+//
+int monitor::timeout( monitor::reactor_ptr r )
+{
+    uint64_t now  = monotonic();
+    uint64_t due  = r->due;
+    int      tick = r->timer.next( now );
+
+    for ( moving::iterator v = r->moves.begin(); v != r->moves.end(); ++v )
+        due = std::min( due, v->second.due );
+
+    if ( due == UINT64_MAX )
+        return tick;
+
+    int held = ( due > now ) ? (int)std::min( due - now, (uint64_t)INT_MAX ) : 0;
+
+    return ( tick < 0 ) ? held : std::min( held, tick );
+}
+
+//
+void monitor::init()
+{
+    boost::unique_lock<boost::shared_mutex> lock( mutex_ );
+
+    size_t n = ( opt_.reactors > 0 ) ? opt_.reactors : 1;
+
+    while ( reactor_.size() < n )
+    {
+        reactor_ptr        r( new reactor( opt_.settle / MONITOR_SETTLE_TICKS ) );
+        struct epoll_event ev;
+
+        reactor_.push_back( r );
+
+        // never smaller than one maximal event or read() fails with EINVAL,
+        // new[] aligns for inotify_event and leaves the bytes uninitialised
+        r->size = ( opt_.buffer > 0 ) ? std::max( opt_.buffer, MONITOR_EVENT ) : MONITOR_BUFFER;
+        r->buff.reset( new char[ r->size ] );
+
+        if ( ( r->fd = ::inotify_init1( IN_NONBLOCK | IN_CLOEXEC ) ) == INVALID_HANDLE )
+            throw std::runtime_error( "Invalid notify file destriptor handle" );
+
+        if ( ( r->ep = ::epoll_create1( EPOLL_CLOEXEC ) ) == INVALID_HANDLE )
+            throw std::runtime_error( "Invalid epoll file destriptor handle" );
+
+        if ( ( r->ev = ::eventfd( 0, EFD_NONBLOCK | EFD_CLOEXEC ) ) == INVALID_HANDLE )
+            throw std::runtime_error( "Invalid event file destriptor handle" );
+
+        memset( &ev, 0, sizeof( ev ) );
+        ev.events = EPOLLIN;
+
+        ev.data.fd = r->fd;
+        if ( ::epoll_ctl( r->ep, EPOLL_CTL_ADD, r->fd, &ev ) < 0 )
+            throw std::runtime_error( "Could not add notification descriptor to epoll" );
+
+        ev.data.fd = r->ev;
+        if ( ::epoll_ctl( r->ep, EPOLL_CTL_ADD, r->ev, &ev ) < 0 )
+            throw std::runtime_error( "Could not add event descriptor to epoll" );
+    }
+}
+
+//
+void monitor::wake()
+{
+    boost::shared_lock<boost::shared_mutex> lock( mutex_ );
+
+    for ( monitor::reactors::iterator r = reactor_.begin(); r != reactor_.end(); ++r )
+    {
+        uint64_t val = 1;
+
+        if ( (*r)->ev != INVALID_HANDLE )
+        {
+            if ( ::write( (*r)->ev, &val, sizeof( val ) ) < 0 )
+                continue;
+        }
+    }
+}
+
+//
+void monitor::close()
+{
+    boost::unique_lock<boost::shared_mutex> lock( mutex_ );
+
+    // closing the inotify descriptor releases all of its watches
+    for ( monitor::reactors::iterator r = reactor_.begin(); r != reactor_.end(); ++r )
+    {
+        if ( (*r)->fd != INVALID_HANDLE ) ::close( (*r)->fd );
+        if ( (*r)->ep != INVALID_HANDLE ) ::close( (*r)->ep );
+        if ( (*r)->ev != INVALID_HANDLE ) ::close( (*r)->ev );
+
+        for ( registry::iterator w = (*r)->watch.begin(); w != (*r)->watch.end(); ++w )
+        {
+            if ( w->second.dir != INVALID_HANDLE ) ::close( w->second.dir );
+        }
+    }
+
+    reactor_.clear();
+    walk_.reset();
+}
+
+//
+monitor::reactor_ptr monitor::shard( std::string const& path )
+{
+    return reactor_[ boost::hash<std::string>()( path ) % reactor_.size() ];
+}
+
+//
+// Register the query with the reactor's inotify instance. New paths use
+// IN_MASK_CREATE so an inode already watched under another (aliased) path
+// is detected and shared, known paths only go back to the kernel when the
+// mask widens, and then with IN_MASK_ADD. Called with mutex_ held
+// exclusively.
+//
+void monitor::add_watch( monitor::reactor_ptr r, monitor::query const& q )
+{
+    boost::mutex::scoped_lock lock( r->lock );
+
+    uint32_t            mask = watching( q );
+    pathindex::iterator p    = r->index.find( q.path );
+    HANDLE              wd;
+
+    if ( p != r->index.end() )
+    {
+        watch&             w = r->watch[ p->second ];
+        branches::iterator b = r->tree.lower_bound( branch( p->second, std::string() ) );
+
+        if ( ( w.mask & mask ) != mask )
+        {
+            bool counted = resynced( w.mask );
+
+            if ( ::inotify_add_watch( r->fd, q.path.c_str(), mask | IN_MASK_ADD ) < 0 )
+                throw std::runtime_error( "Could not add notification monitor" );
+
+            w.mask |= mask;
+
+            if ( ! counted )
+                census( r, p->second, q.path );
+
+            spread( r, p->second, w.mask );
+        }
+
+        w.query.erase( q );
+        w.query.insert( q );
+
+        if ( w.dir == INVALID_HANDLE )
+            w.dir = ::open( q.path.c_str(), O_PATH | O_DIRECTORY | O_CLOEXEC );
+
+        // turned recursive
+        if ( ( q.recur ) && ( ( b == r->tree.end() ) || ( b->first.first != p->second ) ) )
+            plant( r, p->second, q.real );
+
+        return;
+    }
+
+    //
+    if ( ( wd = ::inotify_add_watch( r->fd, q.path.c_str(), mask | MONITOR_MASK_CREATE ) ) < 0 )
+    {
+        // EEXIST: aliased inode, EINVAL: kernel without IN_MASK_CREATE
+        if ( ( errno != EEXIST ) && ( errno != EINVAL ) )
+            throw std::runtime_error( "Could not add notification monitor" );
+
+        if ( ( wd = ::inotify_add_watch( r->fd, q.path.c_str(), mask | IN_MASK_ADD ) ) < 0 )
+            throw std::runtime_error( "Could not add notification monitor" );
+    }
+
+    watch& w     = r->watch[ wd ];
+    bool   fresh = ( w.mask == NONE );
+
+    w.mask |= mask;
+    w.query.erase( q );
+    w.query.insert( q );
+
+    if ( w.dir == INVALID_HANDLE )
+        w.dir = ::open( q.path.c_str(), O_PATH | O_DIRECTORY | O_CLOEXEC );
+
+    r->index[ q.path ] = wd;
+
+    if ( fresh )
+        census( r, wd, q.path );
+
+    if ( q.recur )
+        plant( r, wd, q.real );
+}
+
+//
+// Remove the query from the reactor, the watch itself is only released
+// once no aliased query still depends on it. Called with mutex_ held
+// exclusively.
+//
+void monitor::del_watch( monitor::reactor_ptr r, std::string const& path )
+{
+    boost::mutex::scoped_lock lock( r->lock );
+
+    pathindex::iterator p = r->index.find( path );
+
+    if ( p == r->index.end() )
+        return;
+
+    HANDLE             wd = p->second;
+    registry::iterator w  = r->watch.find( wd );
+
+    r->index.erase( p );
+
+    if ( w == r->watch.end() )
+        return;
+
+    w->second.query.erase( query( path ) );
+
+    bool recur = false;
+
+    for ( queryset::iterator q = w->second.query.begin(); q != w->second.query.end(); ++q )
+        recur |= (*q).recur;
+
+    // the directories below were watched for this query alone, unless this
+    // one is below a recursive query itself
+    if ( ( ! recur ) && ( w->second.parent == INVALID_HANDLE ) )
+    {
+        branches::iterator b = r->tree.lower_bound( branch( wd, std::string() ) );
+
+        while ( ( b != r->tree.end() ) && ( b->first.first == wd ) )
+            prune( r, ( b++ )->second );
+    }
+
+    if ( w->second.parent != INVALID_HANDLE )
+        return;
+
+    if ( w->second.query.empty() )
+    {
+        if ( w->second.dir != INVALID_HANDLE )
+            ::close( w->second.dir );
+
+        ::inotify_rm_watch( r->fd, wd );
+        r->watch.erase( w );
+    }
+    else
+    {
+        uint32_t mask = NONE;
+
+        for ( queryset::iterator q = w->second.query.begin(); q != w->second.query.end(); ++q )
+            mask |= watching( *q );
+
+        // narrowing needs a full replace of the kernel mask
+        if ( mask != w->second.mask )
+        {
+            if ( ::inotify_add_watch( r->fd, w->second.query.begin()->path.c_str(), mask ) >= 0 )
+                w->second.mask = mask;
+        }
+    }
+}
+
+//
+// The kernel released the watch on its own, forget it. Called with the
+// reactor's lock held.
+//
+void monitor::ignored( monitor::reactor_ptr r, HANDLE wd )
+{
+    registry::iterator w = r->watch.find( wd );
+
+    if ( w == r->watch.end() )
+        return;
+
+    for ( queryset::iterator q = w->second.query.begin(); q != w->second.query.end(); ++q )
+        r->index.erase( (*q).path );
+
+    w->second.query.clear();
+    prune( r, wd );
+}
+
+//
+// The mask a query's directory is watched with. options::resync widens it
+// so the entries stay known; a query that asks for creates and deletes
+// anyway only needs the moves added, and is resynced in any case.
+//
+uint32_t monitor::watching( monitor::query const& q ) const
+{
+    uint32_t mask = q.mask | ( ( q.recur ) ? MONITOR_TREE : NONE );
+
+    if ( ( opt_.resync ) || ( ( q.mask & MONITOR_CHURN ) == MONITOR_CHURN ) )
+        mask |= MONITOR_NAMES;
+
+    return mask;
+}
+
+//
+// Count the entries of a directory that is now watched for them and add
+// up their names' hashes (readdir, no stat), events keep both current from
+// here on. No name is kept. Called with the reactor's lock held.
+//
+void monitor::census( monitor::reactor_ptr r, HANDLE wd, std::string const& path )
+{
+    DIR*           dir;
+    struct dirent* e;
+    watch&         w = r->watch[ wd ];
+
+    if ( ! resynced( w.mask ) )
+        return;
+
+    if ( ( dir = ::opendir( path.c_str() ) ) == NULL )
+        return;
+
+    w.count = 0;
+    w.sum   = 0;
+
+    ::clock_gettime( CLOCK_REALTIME_COARSE, &w.counted );
+
+    while ( ( e = ::readdir( dir ) ) != NULL )
+    {
+        if ( ( ::strcmp( e->d_name, "." ) != 0 ) && ( ::strcmp( e->d_name, ".." ) != 0 ) )
+        {
+            w.count++;
+            w.sum += tally( e->d_name );
+        }
+    }
+
+    ::closedir( dir );
+}
+
+//
+// The kernel queue overflowed, events of this reactor's directories were
+// lost. Each directory whose entries are kept count of is read again and
+// compared with them, what changed is routed as if the events had come. Called with the
+// reactor's lock held.
+//
+void monitor::resync( monitor::reactor_ptr r )
+{
+    std::vector<HANDLE> wd;
+
+    wd.reserve( r->watch.size() );
+
+    for ( registry::iterator w = r->watch.begin(); w != r->watch.end(); ++w )
+    {
+        if ( resynced( w->second.mask ) )
+            wd.push_back( w->first );
+    }
+
+    // recounting may grow and prune the tree, look each one up again
+    for ( std::vector<HANDLE>::iterator i = wd.begin(); i != wd.end(); ++i )
+    {
+        if ( r->watch.find( *i ) != r->watch.end() )
+            recount( r, *i );
+    }
+}
+
+//
+// One directory after an overflow. Files whose ctime is not before the
+// queue last ran dry (or the census, if it never has) changed meanwhile;
+// ctime also moves on create, rename and chmod, and the kernel stamps it
+// from the same coarse clock. Those born since as well (statx btime, where
+// the filesystem has it) are new. Below a recursive query the tree knows
+// the subdirectories, new ones are created and missing ones deleted.
+//
+// The count and sum then check the rest: they add up when the new files
+// are all that came (or, without a birth time, when every changed file is
+// new). When they do not, entries went whose names are not known any more:
+// the changed files are sent as they are and the directory itself as
+// modified, a removed file is never named. Called with the reactor's lock
+// held.
+//
+void monitor::recount( monitor::reactor_ptr r, HANDLE wd )
+{
+    std::string              path = where( r, wd );
+    bool                     tree = rooted( r, wd );
+    std::set<std::string>    dirs;
+    std::vector<std::string> changed;
+    std::vector<std::string> fresh;
+    std::vector<std::string> born;
+    std::vector<std::string> gone;
+    size_t                   count = 0;
+    uint64_t                 sum   = 0;
+    uint64_t                 csum  = 0;     // changed files' share of sum
+    uint64_t                 fsum  = 0;     // new files'
+    DIR*                     dir;
+    struct dirent*           e;
+    struct statx             st;
+
+    if ( ( dir = ::opendir( path.c_str() ) ) == NULL )
+        return;
+
+    watch&          w    = r->watch[ wd ];
+    struct timespec from = ( since( r->drained, w.counted ) ) ? r->drained : w.counted;
+
+    while ( ( e = ::readdir( dir ) ) != NULL )
+    {
+        if ( ( ::strcmp( e->d_name, "." ) == 0 ) || ( ::strcmp( e->d_name, ".." ) == 0 ) )
+            continue;
+
+        uint64_t h      = tally( e->d_name );
+        bool     stated = false;
+        bool     isdir  = ( e->d_type == DT_DIR );
+
+        count++;
+        sum += h;
+
+        if ( e->d_type == DT_UNKNOWN )
+        {
+            stated = ( ::statx( ::dirfd( dir ), e->d_name, AT_SYMLINK_NOFOLLOW, STATX_TYPE | STATX_CTIME | STATX_BTIME, &st ) == 0 );
+            isdir  = ( stated ) && ( S_ISDIR( st.stx_mode ) );
+        }
+
+        // a directory's own entries are its watch's business
+        if ( isdir )
+        {
+            dirs.insert( e->d_name );
+
+            if ( ( tree ) && ( r->tree.find( branch( wd, e->d_name ) ) == r->tree.end() ) )
+                born.push_back( e->d_name );
+
+            continue;
+        }
+
+        if ( ( ! stated ) && ( ::statx( ::dirfd( dir ), e->d_name, AT_SYMLINK_NOFOLLOW, STATX_CTIME | STATX_BTIME, &st ) != 0 ) )
+            continue;
+
+        struct timespec ct = { st.stx_ctime.tv_sec, st.stx_ctime.tv_nsec };
+        struct timespec bt = { st.stx_btime.tv_sec, st.stx_btime.tv_nsec };
+
+        if ( ! since( ct, from ) )
+            continue;
+
+        changed.push_back( e->d_name );
+        csum += h;
+
+        if ( ( st.stx_mask & STATX_BTIME ) && ( since( bt, from ) ) )
+        {
+            fresh.push_back( e->d_name );
+            fsum += h;
+        }
+    }
+
+    ::closedir( dir );
+
+    for ( branches::iterator b = r->tree.lower_bound( branch( wd, std::string() ) ); ( b != r->tree.end() ) && ( b->first.first == wd ); ++b )
+    {
+        if ( dirs.find( b->first.second ) == dirs.end() )
+            gone.push_back( b->first.second );
+    }
+
+    // what the entries add up to if no file came or went
+    size_t   n      = w.count + born.size() - gone.size();
+    uint64_t expect = w.sum;
+
+    for ( std::vector<std::string>::iterator d = born.begin(); d != born.end(); ++d )
+        expect += tally( d->c_str() );
+
+    for ( std::vector<std::string>::iterator d = gone.begin(); d != gone.end(); ++d )
+        expect -= tally( d->c_str() );
+
+    bool        exact  = ( count == n + fresh.size() ) && ( sum == expect + fsum );
+    bool        all    = ( ! exact ) && ( count == n + changed.size() ) && ( sum == expect + csum );
+    HANDLE      parent = w.parent;
+    std::string name   = w.name;
+
+    w.count = count;
+    w.sum   = sum;
+
+    if ( all )
+        fresh = changed;
+
+    std::sort( fresh.begin(), fresh.end() );
+
+    // w may move from here on, the tree changes
+    for ( std::vector<std::string>::iterator d = gone.begin(); d != gone.end(); ++d )
+    {
+        branches::iterator b = r->tree.find( branch( wd, *d ) );
+
+        route( r, wd, IN_DELETE | IN_ISDIR, 0, d->c_str() );
+
+        if ( b != r->tree.end() )
+            prune( r, b->second );
+    }
+
+    for ( std::vector<std::string>::iterator f = changed.begin(); f != changed.end(); ++f )
+    {
+        bool made = std::binary_search( fresh.begin(), fresh.end(), *f );
+
+        route( r, wd, ( made ) ? IN_CREATE : IN_MODIFY | IN_CLOSE_WRITE, 0, f->c_str() );
+    }
+
+    for ( std::vector<std::string>::iterator d = born.begin(); d != born.end(); ++d )
+    {
+        route( r, wd, IN_CREATE | IN_ISDIR, 0, d->c_str() );
+        grow( r, wd, d->c_str() );
+    }
+
+    if ( ( exact ) || ( all ) )
+        return;
+
+    if ( parent != INVALID_HANDLE )
+        route( r, parent, IN_MODIFY | IN_ISDIR, 0, name.c_str() );
+    else
+        route( r, wd, IN_MODIFY, 0, NULL );
+}
+
+//
+// Collects the directories (and, for a new one, the files) of a recursive
+// query's tree
+//
+class monitor::survey : public scanner::visitor
+{
+    public:
+        survey( bool files ) : files_( files ) {}
+
+        //
+        bool accept( std::string const& /* path */, size_t /* depth */, size_t& /* tag */ ) { return files_; }
+        void found( std::string const& path, struct stat const& /* st */, size_t depth, size_t /* tag */ ) { file.push_back( scanner::pending( path, depth ) ); }
+        bool enter( std::string const& path, size_t depth ) { dir.push_back( scanner::pending( path, depth ) ); return true; }
+
+        //
+        scanner::visitor* clone() const { return new survey( files_ ); }
+
+        void merge( scanner::visitor& v )
+        {
+            survey& s = static_cast<survey&>( v );
+
+            dir.insert( dir.end(), s.dir.begin(), s.dir.end() );
+            file.insert( file.end(), s.file.begin(), s.file.end() );
+        }
+
+        // parents before their subdirectories
+        void sort() { std::stable_sort( dir.begin(), dir.end(), shallower ); }
+
+        //
+        std::vector<scanner::pending> dir;
+        std::vector<scanner::pending> file;
+
+    protected:
+    private:
+        static bool shallower( scanner::pending const& a, scanner::pending const& b ) { return a.depth < b.depth; }
+
+        bool files_;
+};
+
+//
+// Watch every directory below a recursive query's, the tree is walked in
+// parallel and the watches added parents first. Called with mutex_ held
+// exclusively (walk_) and the reactor's lock.
+//
+void monitor::plant( monitor::reactor_ptr r, HANDLE wd, std::string const& path )
+{
+    survey                                    s( false );
+    boost::unordered_map<std::string, HANDLE> at;
+
+    if ( ! walk_ )
+        walk_.reset( new walker( opt_.walkers ) );
+
+    walk_->walk( path, s );
+    s.sort();
+
+    at[ path ] = wd;
+
+    for ( std::vector<scanner::pending>::iterator d = s.dir.begin(); d != s.dir.end(); ++d )
+    {
+        size_t                                              slash = (*d).path.rfind( '/' );
+        boost::unordered_map<std::string, HANDLE>::iterator p     = at.find( (*d).path.substr( 0, slash ) );
+        HANDLE                                              c;
+
+        if ( p == at.end() )
+            continue;
+
+        if ( ( c = sprout( r, p->second, (*d).path.substr( slash + 1 ), (*d).path ) ) != INVALID_HANDLE )
+            at[ (*d).path ] = c;
+        else if ( errno == ENOSPC )
+            throw std::runtime_error( "Could not add notification monitor, out of watches" );
+    }
+}
+
+//
+// A directory appeared below a recursive query. It is watched and then
+// read, whatever was made in it before the watch was in place is watched
+// and reported as created. Called with the reactor's lock held.
+//
+void monitor::grow( monitor::reactor_ptr r, HANDLE parent, const char* name )
+{
+    std::string                               path = where( r, parent ) + "/" + name;
+    HANDLE                                    wd   = sprout( r, parent, name, path );
+    survey                                    s( true );
+    boost::unordered_map<std::string, HANDLE> at;
+
+    if ( wd == INVALID_HANDLE )
+        return;
+
+    if ( ! r->scan )
+        r->scan.reset( new scanner() );
+
+    r->scan->scan( path, true, s );
+    s.sort();
+
+    at[ path ] = wd;
+
+    for ( std::vector<scanner::pending>::iterator d = s.dir.begin(); d != s.dir.end(); ++d )
+    {
+        size_t                                              slash = (*d).path.rfind( '/' );
+        boost::unordered_map<std::string, HANDLE>::iterator p     = at.find( (*d).path.substr( 0, slash ) );
+        HANDLE                                              c;
+
+        if ( p == at.end() )
+            continue;
+
+        route( r, p->second, IN_CREATE | IN_ISDIR, 0, (*d).path.c_str() + slash + 1 );
+
+        if ( ( c = sprout( r, p->second, (*d).path.substr( slash + 1 ), (*d).path ) ) != INVALID_HANDLE )
+            at[ (*d).path ] = c;
+    }
+
+    for ( std::vector<scanner::pending>::iterator f = s.file.begin(); f != s.file.end(); ++f )
+    {
+        size_t                                              slash = (*f).path.rfind( '/' );
+        boost::unordered_map<std::string, HANDLE>::iterator p     = at.find( (*f).path.substr( 0, slash ) );
+
+        if ( p != at.end() )
+            route( r, p->second, IN_CREATE, 0, (*f).path.c_str() + slash + 1 );
+    }
+}
+
+//
+// Watch one directory below a recursive query, with the mask of the one
+// above it. Returns INVALID_HANDLE when it cannot be (gone already, out of
+// watches). Called with the reactor's lock held.
+//
+HANDLE monitor::sprout( monitor::reactor_ptr r, HANDLE parent, std::string const& name, std::string const& path )
+{
+    uint32_t mask = r->watch[ parent ].mask;
+    HANDLE   wd;
+
+    if ( ( wd = ::inotify_add_watch( r->fd, path.c_str(), mask | IN_ONLYDIR | MONITOR_MASK_CREATE ) ) < 0 )
+    {
+        // already watched, as a query's directory or (moved) within the tree
+        if ( ( errno != EEXIST ) && ( errno != EINVAL ) )
+            return INVALID_HANDLE;
+
+        if ( ( wd = ::inotify_add_watch( r->fd, path.c_str(), mask | IN_ONLYDIR | IN_MASK_ADD ) ) < 0 )
+            return INVALID_HANDLE;
+    }
+
+    watch& w     = r->watch[ wd ];
+    bool   fresh = ( w.mask == NONE );
+
+    if ( w.parent != INVALID_HANDLE )
+        r->tree.erase( branch( w.parent, w.name ) );
+
+    w.mask  |= mask;
+    w.parent = parent;
+    w.name   = name;
+
+    r->tree[ branch( parent, name ) ] = wd;
+
+    if ( fresh )
+        census( r, wd, path );
+
+    return wd;
+}
+
+//
+// A recursive query's mask widened, so do the watches below it. Called with
+// the reactor's lock held.
+//
+void monitor::spread( monitor::reactor_ptr r, HANDLE wd, uint32_t mask )
+{
+    for ( branches::iterator b = r->tree.lower_bound( branch( wd, std::string() ) ); ( b != r->tree.end() ) && ( b->first.first == wd ); ++b )
+    {
+        watch& w = r->watch[ b->second ];
+
+        if ( ( w.mask & mask ) != mask )
+        {
+            bool        counted = resynced( w.mask );
+            std::string path    = where( r, b->second );
+
+            if ( ::inotify_add_watch( r->fd, path.c_str(), mask | IN_ONLYDIR | IN_MASK_ADD ) >= 0 )
+                w.mask |= mask;
+
+            if ( ! counted )
+                census( r, b->second, path );
+        }
+
+        spread( r, b->second, mask );
+    }
+}
+
+//
+// Stop watching a directory below a recursive query and everything below
+// it. One that is a query's directory itself keeps its watch (and its own
+// tree, when recursive) and only leaves the tree. Called with the reactor's
+// lock held.
+//
+void monitor::prune( monitor::reactor_ptr r, HANDLE wd )
+{
+    registry::iterator w = r->watch.find( wd );
+    bool               recur = false;
+
+    if ( w == r->watch.end() )
+        return;
+
+    for ( queryset::iterator q = w->second.query.begin(); q != w->second.query.end(); ++q )
+        recur |= (*q).recur;
+
+    if ( ! recur )
+    {
+        branches::iterator b = r->tree.lower_bound( branch( wd, std::string() ) );
+
+        while ( ( b != r->tree.end() ) && ( b->first.first == wd ) )
+            prune( r, ( b++ )->second );
+    }
+
+    if ( w->second.parent != INVALID_HANDLE )
+        r->tree.erase( branch( w->second.parent, w->second.name ) );
+
+    w->second.parent = INVALID_HANDLE;
+    w->second.name.clear();
+
+    if ( w->second.query.empty() )
+    {
+        if ( w->second.dir != INVALID_HANDLE )
+            ::close( w->second.dir );
+
+        ::inotify_rm_watch( r->fd, wd );
+        r->watch.erase( w );
+    }
+}
+
+//
+// The directory is below (or is) a recursive query's
+//
+bool monitor::rooted( monitor::reactor_ptr r, HANDLE wd )
+{
+    while ( wd != INVALID_HANDLE )
+    {
+        registry::iterator w = r->watch.find( wd );
+
+        if ( w == r->watch.end() )
+            return false;
+
+        for ( queryset::iterator q = w->second.query.begin(); q != w->second.query.end(); ++q )
+        {
+            if ( (*q).recur )
+                return true;
+        }
+
+        wd = w->second.parent;
+    }
+
+    return false;
+}
+
+//
+// The path of a watched directory, put together walking up the tree
+//
+std::string monitor::where( monitor::reactor_ptr r, HANDLE wd )
+{
+    std::string rel;
+
+    for ( ;; )
+    {
+        registry::iterator w = r->watch.find( wd );
+
+        if ( w == r->watch.end() )
+            return rel;
+
+        if ( w->second.parent == INVALID_HANDLE )
+        {
+            std::string top = ( w->second.query.empty() ) ? std::string() : w->second.query.begin()->real;
+
+            return ( rel.empty() ) ? top : top + "/" + rel;
+        }
+
+        rel = ( rel.empty() ) ? w->second.name : w->second.name + "/" + rel;
+        wd  = w->second.parent;
+    }
+}
+
+//
+bool monitor::matches( monitor::record& m, std::string const& name, monitor::query const& q, uint32_t mask, matchset::state& st, bool nested, HANDLE at /*= -1*/, const char* base /*= NULL*/ )
+{
+    bool             ok   = false;
+    bool             meta = false;
+    metrics::meter*  mt   = q.meter.get();
+
+    m.event = event_none;
+
+    if ( mt )
+        metrics::count( mt->events );
+
+    if ( ( q.expr ) && ( q.expr->matches( name, st ) ) )
+    {
+        for ( size_t i = 0; i < q.match.size(); ++i )
+        {
+            // below the query's directory only recursive filters count
+            if ( ( st.hit( i ) ) && ( ( ! nested ) || ( q.match[ i ].recur ) ) && ( mask & q.match[ i ].event ) )
             {
-                if ( boost::filesystem::is_regular_file( *path ) )
-                {
-                    message m;
+                if ( ! ok )
+                    m.match = (uint32_t)i;
+
+                m.event = (events)( m.event | ( mask & q.match[ i ].event ) );
+                meta   |= q.match[ i ].meta;
+                ok      = true;
+            }
+        }
+    }
+
+    // only filters that want the metadata pay for it, and a deleted or
+    // moved-from name is gone already; relative to the directory when it is
+    // held open
+    if ( ( ok ) && ( meta ) && ( ! ( mask & ( IN_DELETE | IN_MOVED_FROM ) ) ) )
+    {
+        struct stat buf;
+        int         rc;
+
+        if ( ( at != INVALID_HANDLE ) && ( base ) )
+            rc = ::fstatat( at, base, &buf, 0 );
+        else
+            rc = ::stat( name.c_str(), &buf );
+
+        if ( mt )
+            metrics::count( mt->stats );
+
+        if ( ( ok = ( rc == 0 ) ) )
+        {
+            m.ino   = buf.st_ino;
+            m.size  = buf.st_size;
+            m.mtime = buf.st_mtim;
+        }
+    }
+
+    if ( mt )
+        metrics::count( ok ? mt->matched : mt->dropped );
+
+    return ok;
+}
+
+//
+monitor::message::message( monitor::messages const& b, monitor::record const& r )
+    : name( b.text( r.name ) ),
+      ino( r.ino ),
+      size( r.size ),
+      mtime( r.mtime ),
+      event( r.event ),
+      from( b.text( r.from ) ),
+      match( b.match( r.match ) )
+{
+}
+
+//
+// A named filter replaces the one with the same name, an unnamed one the
+// filter with the same expression
+//
+template <typename filters>
+static size_t place( filters const& match, typename filters::value_type const& f )
+{
+    for ( size_t i = 0; i < match.size(); ++i )
+    {
+        if ( ( f.name.length() > 0 ) ? ( match[ i ].name == f.name )
+                                     : ( ( match[ i ].name.length() == 0 ) &&
+                                         ( match[ i ].regex == f.regex ) &&
+                                         ( match[ i ].syntax == f.syntax ) ) )
+            return i;
+    }
+
+    return match.size();
+}
+
+//
+template <typename filters>
+static size_t named( filters const& match, std::string const& name )
+{
+    for ( size_t i = 0; i < match.size(); ++i )
+    {
+        if ( match[ i ].name == name )
+            return i;
+    }
+
+    return match.size();
+}
+
+//
+void monitor::query::add( monitor::filter const& f )
+{
+    matcher_ptr x( new matcher( f.regex, f.syntax ) );   // throws before anything changes
+    matchers    all;
+    size_t      i = place( match, f );
+
+    if ( expr )
+        all = expr->expressions();
+
+    if ( i < match.size() )
+    {
+        match[ i ] = f;
+        all[ i ]   = x;
+    }
+    else
+    {
+        match.push_back( f );
+        all.push_back( x );
+    }
+
+    expr.reset( new matchset( all ) );
+    mask  = NONE;
+    recur = false;
+
+    for ( i = 0; i < match.size(); ++i )
+    {
+        mask  |= (uint32_t)( match[ i ].event );
+        recur |= match[ i ].recur;
+    }
+
+    // pairing a move takes both of its halves
+    if ( mask & IN_MOVE )
+        mask |= IN_MOVE;
+}
+
+//
+bool monitor::query::del( std::string const& name )
+{
+    size_t i = named( match, name );
+
+    if ( i == match.size() )
+        return false;
+
+    matchers all( expr->expressions() );
+
+    match.erase( match.begin() + i );
+    all.erase( all.begin() + i );
+
+    expr.reset( new matchset( all ) );
+    mask  = NONE;
+    recur = false;
+
+    for ( i = 0; i < match.size(); ++i )
+    {
+        mask  |= (uint32_t)( match[ i ].event );
+        recur |= match[ i ].recur;
+    }
+
+    // pairing a move takes both of its halves
+    if ( mask & IN_MOVE )
+        mask |= IN_MOVE;
+
+    return true;
+}
+
+//
+bool monitor::expired( time_t tm, int sec )
+{
+    return ( tm > 0 ) ? ( ::difftime( ::time( NULL ), tm ) >= sec ) : false;
+}
+
+//
+void monitor::deliver( monitor::messages_ptr const& msg )
+{
+    uint64_t began = metrics::clock();
+
+    sig_( msg );
+    meter_.emitted( metrics::clock() - began );
+}
+
+//
+bool monitor::connected()
+{
+    return ( ! sig_.empty() );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// class polling
+//
+////////////////////////////////////////////////////////////////////////////////
+
+//
+// The starting interval of a query, its wait held within its bounds when
+// adaptive
+//
+static size_t bound( polling::query const& q, size_t ms )
+{
+    if ( q.high == 0 )
+        return ms;
+
+    return std::min( std::max( ms, q.low ), q.high );
+}
+
+//
+polling::polling( polling::options opt /*= polling::options()*/ )
+    : run_( false ),
+      opt_( opt ),
+      timer_( POLLING_TICK, POLLING_SLOTS ),
+      seed_( monotonic() | 1 ),
+      send_( opt_.queue,
+             boost::bind( &polling::deliver, this, _1 ),
+             boost::bind( &absorbed<messages>, _1, _2 ),
+             boost::bind( &sealed<messages>, _1, opt_.order ) ),
+      meter_( "polling", metrics::source_scan )
+{
+    meter_.queue = boost::bind( &polling::queued, this );
+}
+
+//
+polling::polling( const polling::slot_t& handler, polling::options opt /*= polling::options()*/ )
+    : run_( false ),
+      opt_( opt ),
+      timer_( POLLING_TICK, POLLING_SLOTS ),
+      seed_( monotonic() | 1 ),
+      send_( opt_.queue,
+             boost::bind( &polling::deliver, this, _1 ),
+             boost::bind( &absorbed<messages>, _1, _2 ),
+             boost::bind( &sealed<messages>, _1, opt_.order ) ),
+      meter_( "polling", metrics::source_scan )
+{
+    meter_.queue = boost::bind( &polling::queued, this );
+    con_ = sig_.connect( handler );
+}
+
+//
+polling::~polling()
+{
+    if ( run_ )
+        stop();
+
+    con_.disconnect();
+}
+
+//
+void polling::add_directory( std::string dir, polling::filter match /*= polling::filter()*/, size_t ms /*= 0*/, size_t low /*= 0*/, size_t high /*= 0*/ )
+{
+    boost::mutex::scoped_lock lock( mutex_ );
+
+    if ( ! boost::filesystem::is_directory( dir ) ) 
+        throw std::invalid_argument( "polling::add_directory: " + dir + " is not a valid directory entry" ); 
+
+    query              q( dir );
+    queryset::iterator i = query_.find( q );
+
+    // filters accumulate on a directory, the latest interval wins
+    if ( i != query_.end() )
+        q = (*i);
+
+    q.add( match );
+    q.wait = ms;
+    q.low  = std::min( low, high );
+    q.high = high;
+    q.real = boost::filesystem::canonical( dir ).string();
+
+    if ( ! q.meter )
+        q.meter = meter_.add( dir );
+
+    query_.erase( q );
+    query_.insert( q );
+
+    if ( ! run_ )
+        return;
+
+    // running, the next scan takes the new filters or a new directory is
+    // scheduled right away
+    tasks::iterator t = task_.find( q.path );
+
+    if ( ( q.recur ) && ( ! walk_ ) )
+        walk_.reset( new walker( opt_.walkers, opt_.meta ) );
+
+    if ( t != task_.end() )
+    {
+        t->second->qry = q;
+        t->second->stat.interval = bound( q, q.wait );
+    }
+    else
+    {
+        task_ptr n( new task( q ) );
+
+        n->stat.interval = bound( q, q.wait );
+
+        task_[ q.path ] = n;
+        due( n, n->stat.interval, true );
+    }
+}
+
+//
+void polling::del_directory( std::string dir )
+{
+    boost::mutex::scoped_lock lock( mutex_ );
+    query_.erase( query( dir ) );
+    meter_.del( dir );
+
+    tasks::iterator t = task_.find( dir );
+
+    if ( t != task_.end() )
+    {
+        t->second->live = false;
+        task_.erase( t );
+    }
+}
 
-                    m.name = ( *path ).path().c_str();
-                    m.match = dir.match;
+//
+void polling::del_directory( std::string dir, std::string name )
+{
+    boost::mutex::scoped_lock lock( mutex_ );
 
-                    if ( matches( m ) )
-                        msg.insert( m );
-                }
+    queryset::iterator i = query_.find( query( dir ) );
+
+    if ( i == query_.end() )
+        return;
+
+    query q = (*i);
+
+    if ( ! q.del( name ) )
+        return;
+
+    query_.erase( i );
+
+    if ( q.match.size() > 0 )
+        query_.insert( q );
+    else
+        meter_.del( dir );
+
+    tasks::iterator t = task_.find( dir );
+
+    if ( t == task_.end() )
+        return;
+
+    if ( q.match.size() > 0 )
+        t->second->qry = q;
+    else
+    {
+        t->second->live = false;
+        task_.erase( t );
+    }
+}
+
+//
+// One scheduler thread keeps every directory on a timer wheel by its next
+// scan, and hands those due to a fixed pool of workers
+//
+void polling::start()
+{
+    boost::mutex::scoped_lock lock( mutex_ );
+
+    size_t n = ( opt_.workers > 0 ) ? opt_.workers : std::max( boost::thread::hardware_concurrency(), 1u );
+
+    run_ = true;
+
+    for ( polling::queryset::iterator q = query_.begin(); q != query_.end(); ++q )
+    {
+        task_ptr t( new task( *q ) );
+
+        if ( ( (*q).recur ) && ( ! walk_ ) )
+            walk_.reset( new walker( opt_.walkers, opt_.meta ) );
+
+        t->stat.interval = bound( *q, (*q).wait );
+
+        task_[ (*q).path ] = t;
+        due( t, t->stat.interval, true );
+    }
+
+    send_.start();
+
+    pool_.create_thread( boost::bind( &polling::schedule, this ) );
+
+    for ( size_t i = 0; i < n; ++i )
+        pool_.create_thread( boost::bind( &polling::work, this ) );
+}
+
+//
+void polling::stop()
+{
+    {
+        boost::mutex::scoped_lock lock( mutex_ );
+
+        run_ = false;
+
+        cond_.notify_all();
+        tick_.notify_all();
+    }
+
+    interrupt();
+    join();
+
+    // what the workers queued still goes out
+    send_.stop();
+
+    task_.clear();
+    ready_.clear();
+    timer_.clear();
+    walk_.reset();
+}
+
+//
+void polling::interrupt()
+{
+    pool_.interrupt_all();
+}
+
+//
+void polling::join()
+{
+    pool_.join_all();
+}
+
+
+//
+polling::connection polling::connect( const polling::slot_t& handler )
+{
+    return ( con_ = sig_.connect( handler ) );
+}
+
+//
+bool polling::stats( std::string dir, polling::statistics& s )
+{
+    boost::mutex::scoped_lock lock( mutex_ );
+
+    tasks::const_iterator t = task_.find( dir );
+
+    if ( t == task_.end() )
+        return false;
+
+    s = t->second->stat;
+    return true;
+}
+
+//
+// Move the due directories from the wheel to the workers, sleeping until
+// the next slot that holds any
+//
+void polling::schedule()
+{
+    try
+    {
+        boost::mutex::scoped_lock lock( mutex_ );
+        std::vector<task_ptr>     due;
+
+        while ( run_ )
+        {
+            due.clear();
+            timer_.expire( monotonic(), due );
+
+            for ( std::vector<task_ptr>::iterator t = due.begin(); t != due.end(); ++t )
+            {
+                // deleted while it waited
+                if ( ! (*t)->live )
+                    continue;
+
+                ready_.push_back( *t );
+                cond_.notify_one();
             }
 
-            try
+            int ms = timer_.next( monotonic() );
+
+            if ( ms < 0 )
+                tick_.wait( lock );
+            else if ( ms > 0 )
+                tick_.timed_wait( lock, boost::posix_time::milliseconds( ms ) );
+        }
+    }
+    catch ( boost::thread_interrupted const& )
+    {
+        // interuption is expected, so do nothing
+    }
+}
+
+//
+// A worker, with its own scanner, scans whatever is due and puts it back on
+// the wheel
+//
+void polling::work()
+{
+    try
+    {
+        scanner scan( 0, metadata::create( opt_.meta ) );
+
+        while ( run_ )
+        {
+            task_ptr t;
+
             {
-                ++path;
+                boost::mutex::scoped_lock lock( mutex_ );
+
+                while ( ( run_ ) && ( ready_.empty() ) )
+                    cond_.wait( lock );
+
+                if ( ! run_ )
+                    break;
+
+                t = ready_.front();
+                ready_.pop_front();
             }
-            catch ( const boost::filesystem::filesystem_error )
+
+            uint64_t           began = metrics::clock();
+            size_t             seen  = 0;
+            size_t             sent  = pass( *t, scan, seen );
+            uint64_t           us    = metrics::clock() - began;
+            metrics::meter_ptr mt;
+
             {
-                continue;
+                boost::mutex::scoped_lock lock( mutex_ );
+
+                t->stat.busy    += us;
+                t->stat.longest  = std::max( t->stat.longest, us );
+                adapt( *t, sent );
+
+                if ( ( run_ ) && ( t->live ) )
+                    due( t, t->stat.interval, false );
+
+                mt = t->qry.meter;
             }
 
-            //
-            boost::this_thread::yield();
+            if ( mt )
+            {
+                metrics::count( mt->scans );
+                metrics::count( mt->scan_us, us );
+                metrics::most( mt->scan_max_us, us );
+                metrics::count( mt->matched, sent );
+                metrics::count( mt->entries, seen );
+            }
         }
     }
+    catch ( boost::thread_interrupted const& )
+    {
+        // interuption is expected, so do nothing
+    }
 }
 
 //
-bool polling::wait( size_t ms )
+// One scan of one directory, the differences from the last are sent on.
+// Returns the number of messages, seen is the directory entries visited.
+//
+size_t polling::pass( polling::task& t, scanner& scan, size_t& seen )
 {
-    bool ok = false;
-    boost::mutex::scoped_lock lock( mutex_ );
-    boost::system_time timeout = boost::get_system_time()
-                               + boost::posix_time::milliseconds( ( ms == 0 ) ? 1 : ms );
-    
-    ok = ( ! cond_.timed_wait( lock, timeout ) ); // returns false on timeout ... which in our case is "true"
-    boost::this_thread::yield();
+    query                     q;
+    boost::shared_ptr<walker> walk;     // add_directory() may set walk_
 
-    return ok;
+    {
+        boost::mutex::scoped_lock lock( mutex_ );
+
+        q    = t.qry;
+        walk = walk_;
+    }
+
+    // what is sent is shared and kept by the slots, so each pass starts a
+    // new batch, sized after the last listing
+    boost::shared_ptr<messages> msg( new messages( q.match ) );
+    messages                    now( q.match );
+
+    now.reserve( t.snap.size(), t.bytes );
+
+    seen = list( q, scan, walk.get(), now );
+    diff( t.snap, now, *msg );
+
+    t.bytes = now.bytes();
+
+    if ( ( msg->size() ) && ( connected() ) )
+        send_.push( messages_ptr( msg ) );
+
+    return msg->size();
 }
 
 //
-bool polling::matches( polling::message& m )
+// Count the scan and pick the interval to the next. An adaptive query
+// drops to its low bound as soon as a scan finds a change, and stays there
+// while the quiet since is short of twice the usual gap between changes
+// (or of the high bound, whichever is less). After that it doubles with
+// every empty scan, up to the high bound. A directory changing at a steady
+// rate is so never backed off between changes. A fixed query keeps its
+// wait. Called with mutex_ held.
+//
+void polling::adapt( polling::task& t, size_t sent )
 {
-    bool ok = false;
+    statistics& s   = t.stat;
+    uint64_t    now = monotonic();
 
-    if ( ::stat( m.name.c_str(), &( m.stat ) ) == 0 )
+    s.scans++;
+    s.entries = t.snap.size();
+
+    if ( sent > 0 )
     {
-        if ( m.match.regex.length() > 0 )
+        // the first change only starts the clock
+        if ( t.last > 0 )
+            s.gap = ( s.gap == 0 ) ? now - t.last : ( s.gap * 3 + ( now - t.last ) ) / 4;
+
+        t.last = now;
+
+        s.changed++;
+        s.messages += sent;
+        s.idle = 0;
+    }
+    else
+        s.idle++;
+
+    if ( t.qry.high == 0 )
+        s.interval = t.qry.wait;
+    else if ( sent > 0 )
+        s.interval = t.qry.low;
+    else if ( now - t.last >= std::min( s.gap * 2, (uint64_t)t.qry.high ) )
+        s.interval = std::min( std::max( s.interval, (size_t)1 ) * 2, t.qry.high );
+}
+
+//
+// Put the directory on the wheel for its next scan, the interval varied by
+// up to options::jitter percent so directories added together drift apart.
+// The first scan falls anywhere within one interval. Called with mutex_
+// held.
+//
+void polling::due( polling::task_ptr t, size_t ms, bool first )
+{
+    uint64_t span = std::max( ms, (size_t)1 );
+    uint64_t jit  = span * std::min( opt_.jitter, (size_t)100 ) / 100;
+    uint64_t at;
+
+    // xorshift64, jitter need not be any better
+    seed_ ^= seed_ << 13;
+    seed_ ^= seed_ >> 7;
+    seed_ ^= seed_ << 17;
+
+    if ( first )
+        at = seed_ % ( span + 1 );
+    else
+        at = span - jit + seed_ % ( 2 * jit + 1 );
+
+    timer_.add( monotonic() + at, t );
+    tick_.notify_one();
+}
+
+//
+// Collects the files of one scan, the name is tested (and the filter picked,
+// handed back as the tag) before the scanner reads any metadata
+//
+class polling::lister : public scanner::visitor
+{
+    public:
+        lister( polling::query const& q, polling::messages& msg ) : qry_( q ), own_( q.match ), msg_( msg ) {}
+        lister( polling::query const& q ) : qry_( q ), own_( q.match ), msg_( own_ ) {}
+
+        //
+        bool accept( std::string const& path, size_t depth, size_t& tag )
         {
-            boost::regex glob( m.match.regex );
+            if ( ( ! qry_.expr ) || ( ! qry_.expr->matches( path, st_ ) ) )
+                return false;
+
+            // files below the top directory only match recursive filters
+            for ( tag = 0; tag < qry_.match.size(); ++tag )
+            {
+                if ( ( st_.hit( tag ) ) && ( ( depth == 0 ) || ( qry_.match[ tag ].recur ) ) )
+                    return true;
+            }
 
-            if ( boost::regex_search( m.name, glob ) )
-                ok = true;
+            return false;
         }
-        else
-            ok = true;
+
+        //
+        void found( std::string const& path, struct stat const& st, size_t /* depth */, size_t tag )
+        {
+            polling::record m;
+
+            // the scanner stats every name accepted, once
+            if ( qry_.meter )
+                metrics::count( qry_.meter->stats );
+
+            m.name  = msg_.intern( path );
+            m.dev   = st.st_dev;
+            m.ino   = st.st_ino;
+            m.size  = st.st_size;
+            m.mtime = st.st_mtim;
+            m.ctime = st.st_ctim;
+            m.match = (uint32_t)tag;
+
+            msg_.push( m );
+        }
+
+        //
+        scanner::visitor* clone() const { return new lister( qry_ ); }
+
+        void merge( scanner::visitor& v )
+        {
+            polling::messages const& other = static_cast<lister&>( v ).msg_;
+
+            for ( polling::messages::records::const_iterator r = other.raw().begin(); r != other.raw().end(); ++r )
+            {
+                polling::record m( *r );
+
+                m.name = msg_.intern( other.text( (*r).name ) );
+                msg_.push( m );
+            }
+        }
+
+    protected:
+    private:
+        polling::query const& qry_;
+        polling::messages     own_;     // clones collect here
+        polling::messages&    msg_;
+        matchset::state       st_;
+};
+
+//
+size_t polling::list( polling::query const& dir, scanner& scan, walker* walk, polling::messages& msg )
+{
+    lister found( dir, msg );
+    size_t seen;
+
+    // recursive listings have always reported canonical names
+    if ( ( dir.recur ) && ( walk ) )
+        seen = walk->walk( dir.real, found );
+    else if ( dir.recur )
+        seen = scan.scan( dir.real, true, found );
+    else
+        seen = scan.scan( dir.path, false, found );
+
+    // in name order (unordered, scan order) the first of two hard links is
+    // the one tracked
+    msg.seal( opt_.order );
+
+    return seen;
+}
+
+//
+// Compare the listing against the last snapshot, only the differences are
+// sent on. A name that is gone under one inode but present under another
+// was replaced, and is reported as modified rather than removed and added.
+//
+void polling::diff( polling::snapshot& snap, polling::messages const& now, polling::messages& msg )
+{
+    snapshot            next;
+    std::vector<record> added;
+
+    for ( messages::records::const_iterator m = now.raw().begin(); m != now.raw().end(); ++m )
+    {
+        identity id( (*m).dev, (*m).ino );
+        entry    e;
+
+        e.name  = now.text( (*m).name ).to_string();
+        e.size  = (*m).size;
+        e.mtime = (*m).mtime;
+        e.ctime = (*m).ctime;
+        e.match = (*m).match;
+
+        if ( ! next.insert( std::make_pair( id, e ) ).second )
+            continue;
+
+        //
+        snapshot::iterator o = snap.find( id );
+        record             d( *m );
+
+        d.name = msg.intern( e.name );
+
+        if ( o == snap.end() )
+        {
+            d.change = change_added;
+            added.push_back( d );
+
+            continue;
+        }
+
+        if ( o->second.name != e.name )
+        {
+            d.change = change_renamed;
+            d.from   = msg.intern( o->second.name );
+        }
+        else if ( ( o->second.size          != e.size          ) ||
+                  ( o->second.mtime.tv_sec  != e.mtime.tv_sec  ) ||
+                  ( o->second.mtime.tv_nsec != e.mtime.tv_nsec ) ||
+                  ( o->second.ctime.tv_sec  != e.ctime.tv_sec  ) ||
+                  ( o->second.ctime.tv_nsec != e.ctime.tv_nsec ) )
+            d.change = change_modified;
+
+        snap.erase( o );
+
+        if ( d.change != change_none )
+            msg.push( d );
     }
 
-    return ok;
+    // what is left of the last scan is gone, unless its name came back
+    if ( ( added.size() > 0 ) && ( snap.size() > 0 ) )
+    {
+        boost::unordered_map<std::string, snapshot::iterator> gone;
+
+        for ( snapshot::iterator o = snap.begin(); o != snap.end(); ++o )
+            gone[ o->second.name ] = o;
+
+        for ( std::vector<record>::iterator d = added.begin(); d != added.end(); ++d )
+        {
+            boost::unordered_map<std::string, snapshot::iterator>::iterator g = gone.find( msg.text( (*d).name ).to_string() );
+
+            if ( g != gone.end() )
+            {
+                (*d).change = change_modified;
+                snap.erase( g->second );
+                gone.erase( g );
+            }
+        }
+    }
+
+    for ( std::vector<record>::iterator d = added.begin(); d != added.end(); ++d )
+        msg.push( *d );
+
+    for ( snapshot::iterator o = snap.begin(); o != snap.end(); ++o )
+    {
+        record d;
+
+        // renamed over, already reported under this name
+        if ( msg.interned( o->second.name ) )
+            continue;
+
+        d.name   = msg.intern( o->second.name );
+        d.dev    = o->first.first;
+        d.ino    = o->first.second;
+        d.size   = o->second.size;
+        d.mtime  = o->second.mtime;
+        d.ctime  = o->second.ctime;
+        d.change = change_removed;
+        d.match  = o->second.match;
+
+        msg.push( d );
+    }
+
+    msg.seal( opt_.order );
+    snap.swap( next );
+}
+
+//
+void polling::query::add( polling::filter const& f )
+{
+    matcher_ptr x( new matcher( f.regex, f.syntax ) );   // throws before anything changes
+    matchers    all;
+    size_t      i = place( match, f );
+
+    if ( expr )
+        all = expr->expressions();
+
+    if ( i < match.size() )
+    {
+        match[ i ] = f;
+        all[ i ]   = x;
+    }
+    else
+    {
+        match.push_back( f );
+        all.push_back( x );
+    }
+
+    expr.reset( new matchset( all ) );
+    recur = false;
+
+    for ( i = 0; i < match.size(); ++i )
+        recur |= match[ i ].recur;
+}
+
+//
+bool polling::query::del( std::string const& name )
+{
+    size_t i = named( match, name );
+
+    if ( i == match.size() )
+        return false;
+
+    matchers all( expr->expressions() );
+
+    match.erase( match.begin() + i );
+    all.erase( all.begin() + i );
+
+    expr.reset( new matchset( all ) );
+    recur = false;
+
+    for ( i = 0; i < match.size(); ++i )
+        recur |= match[ i ].recur;
+
+    return true;
+}
+
+//
+polling::message::message( polling::messages const& b, polling::record const& r )
+    : name( b.text( r.name ) ),
+      ino( r.ino ),
+      size( r.size ),
+      mtime( r.mtime ),
+      change( r.change ),
+      from( b.text( r.from ) ),
+      match( b.match( r.match ) )
+{
 }
 
 //
@@ -489,6 +2457,15 @@ bool polling::expired( time_t tm, int sec )
     return ( tm > 0 ) ? ( ::difftime( ::time( NULL ), tm ) >= sec ) : false;
 }
 
+//
+void polling::deliver( polling::messages_ptr const& msg )
+{
+    uint64_t began = metrics::clock();
+
+    sig_( msg );
+    meter_.emitted( metrics::clock() - began );
+}
+
 //
 bool polling::connected()
 {
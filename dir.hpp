@@ -22,18 +22,35 @@
 #include <sys/inotify.h>
 
 // c++
+#include <map>
+#include <set>
+#include <deque>
 #include <string>
 #include <vector>
 
 // boost
+#include <boost/atomic.hpp>
 #include <boost/thread.hpp>
 #include <boost/function.hpp>
-#include <boost/signals2.hpp>
 #include <boost/shared_ptr.hpp>
+#include <boost/shared_array.hpp>
+#include <boost/unordered_set.hpp>
+#include <boost/unordered_map.hpp>
 #include <boost/thread/locks.hpp>
 #include <boost/thread/shared_mutex.hpp>
 
+#ifdef DIRECTORY_SIGNALS2
+#include <boost/signals2.hpp>
+#endif
+
 // local
+#include "scan.hpp"
+#include "batch.hpp"
+#include "wheel.hpp"
+#include "dispatch.hpp"
+#include "fanout.hpp"
+#include "metric.hpp"
+#include "match.hpp"
 
 // flag for gcc version 4.7.3 or higher
 #if  __GNUC__           >= 4 && \
@@ -50,6 +67,16 @@
 
 #define HANDLE int
 
+// slots held by boost::signals2 rather than the copy-on-write fanout, for
+// slot tracking, groups or combiners
+#ifdef DIRECTORY_SIGNALS2
+#define DIRECTORY_CONNECTION    boost::signals2::connection
+#define DIRECTORY_SIGNAL( a )   boost::signals2::signal<void (a)>
+#else
+#define DIRECTORY_CONNECTION    fanout_base::connection
+#define DIRECTORY_SIGNAL( a )   fanout<a>
+#endif
+
 //
 namespace mti { namespace audit { namespace shield {
 
@@ -99,7 +126,7 @@ class monitor
 {
     public:
         //
-        typedef boost::signals2::connection connection;
+        typedef DIRECTORY_CONNECTION connection;
 
         //
         enum events
@@ -116,6 +143,7 @@ class monitor
             event_move_self      = IN_MOVE_SELF,
             event_moved_from     = IN_MOVED_FROM,
             event_moved_to       = IN_MOVED_TO,
+            event_renamed        = IN_MOVE,         // both halves of a move, paired
             event_opened         = IN_OPEN,
             event_all            = IN_ALL_EVENTS
         };
@@ -123,38 +151,71 @@ class monitor
         //
         struct filter
         {
-            filter() : name( "" ), regex( "" ), event( event_all ) {}
-            filter( events e ) : name( "" ), regex( "" ), event( e ) {}
-            filter( std::string n, std::string x ) : name( n ), regex( x ), event( event_all ) {}
-            filter( std::string n, std::string x, events e ) : name( n ), regex( x ), event( e ) {}
-
-            std::string name;   // named identifier (registry)
-            std::string regex;  // glob expression
-            enum events event;  // monitor events
+            filter() : name( "" ), regex( "" ), event( event_all ), syntax( matcher::syntax_glob ), recur( false ), meta( true ) {}
+            filter( events e ) : name( "" ), regex( "" ), event( e ), syntax( matcher::syntax_glob ), recur( false ), meta( true ) {}
+            filter( std::string n, std::string x ) : name( n ), regex( x ), event( event_all ), syntax( matcher::syntax_glob ), recur( false ), meta( true ) {}
+            filter( std::string n, std::string x, events e ) : name( n ), regex( x ), event( e ), syntax( matcher::syntax_glob ), recur( false ), meta( true ) {}
+            filter( std::string n, std::string x, events e, bool r ) : name( n ), regex( x ), event( e ), syntax( matcher::syntax_glob ), recur( r ), meta( true ) {}
+            filter( std::string n, std::string x, events e, matcher::syntax s ) : name( n ), regex( x ), event( e ), syntax( s ), recur( false ), meta( true ) {}
+            filter( std::string n, std::string x, events e, matcher::syntax s, bool r ) : name( n ), regex( x ), event( e ), syntax( s ), recur( r ), meta( true ) {}
+
+            std::string          name;      // named identifier (registry)
+            std::string          regex;     // glob expression
+            enum events          event;     // monitor events
+            enum matcher::syntax syntax;    // glob (default) or regular expression
+            bool                 recur;     // recursive, every directory below is watched too
+            bool                 meta;      // fill in ino, size and mtime (a stat per event)
 
             filter& operator=( filter const& f )
             {
-                name  = f.name;
-                regex = f.regex;
-                event = f.event;
+                name   = f.name;
+                regex  = f.regex;
+                event  = f.event;
+                syntax = f.syntax;
+                recur  = f.recur;
+                meta   = f.meta;
 
                 return *this;
             }
+
+            bool operator==( filter const& f ) const
+            {
+                return ( name == f.name ) && ( regex == f.regex ) && ( event == f.event ) &&
+                       ( syntax == f.syntax ) && ( recur == f.recur ) && ( meta == f.meta );
+            }
         };
 
+        //
+        typedef std::vector<filter> filters;
+
         //
         struct query
         {
-            query() {}
-            query( std::string p, filter m = filter() ) : path( p ), match( m ) {}
+            query() : mask( NONE ), recur( false ) {}
+            query( std::string p ) : path( p ), mask( NONE ), recur( false ) {}
+            query( std::string p, filter m ) : path( p ), mask( NONE ), recur( false ) { add( m ); }
+
+            std::string  path;
+            std::string  real;      // path resolved once (canonical), names are built on it
+            filters      match;     // named filters
+            uint32_t     mask;      // events of every filter
+            bool         recur;     // any filter recursive
+            matchset_ptr expr;      // compiled match[].regex (shared)
+
+            metrics::meter_ptr meter;   // counters, shared by every copy
 
-            std::string path;
-            filter      match;
+            void add( filter const& f );
+            bool del( std::string const& name );
 
             query& operator=( query const& q )
             {
                 path  = q.path;
+                real  = q.real;
                 match = q.match;
+                mask  = q.mask;
+                recur = q.recur;
+                expr  = q.expr;
+                meter = q.meter;
 
                 return *this;
             }
@@ -169,48 +230,93 @@ class monitor
         typedef std::set<query> queryset;
 
         //
-        struct message
-        {
-            message() : name( "" ) { memset( &stat, 0, sizeof( struct stat ) ); }
-            message( std::string n ) : name( n ) { memset( &stat, 0, sizeof( struct stat ) ); }
+        struct message;
 
-            std::string name;
-            struct stat stat;
+        //
+        struct record
+        {
+            record() : ino( 0 ), size( 0 ), name( 0 ), from( 0 ), match( 0 ), event( event_none ) { mtime.tv_sec = mtime.tv_nsec = 0; }
+
+            ino_t           ino;
+            off_t           size;
+            struct timespec mtime;
+            uint32_t        name;   // offset in the batch
+            uint32_t        from;   // previous name (renamed), offset in the batch
+            uint32_t        match;  // index of the first filter matched
+            enum events     event;
+        };
 
-            enum events  event;
-            filter       match;
+        //
+        typedef batch<record, message, filter> messages;
+        typedef boost::shared_ptr<const messages> messages_ptr;
 
-            message& operator=( message const& m )
-            {
-                name  = m.name;
-                stat  = m.stat;
-                event = m.event;
-                match = m.match;
+        //
+        struct message
+        {
+            message( messages const& b, record const& r );
 
-                return *this;
-            }
+            boost::string_ref name;
+            ino_t             ino;
+            off_t             size;
+            struct timespec   mtime;
 
-            bool operator<( const message& m ) const
-            {
-                return name < m.name;
-            }
+            enum events       event;
+            boost::string_ref from;     // previous name (event_renamed)
+            filter const&     match;    // first filter matched
         };
 
         //
-        typedef std::set<message> messages;
+        typedef DIRECTORY_SIGNAL( messages_ptr ) signal_t;
+        typedef signal_t::slot_type slot_t;
 
         //
-        typedef boost::signals2::signal<void (messages)> signal_t;
-        typedef signal_t::slot_type slot_t;
+        struct options
+        {
+            options() : reactors( 1 ), buffer( 0 ), order( true ), window( 0 ), limit( 0 ), settle( 0 ), moves( 10 ), walkers( 0 ), resync( false ) {}
+            options( size_t r ) : reactors( r ), buffer( 0 ), order( true ), window( 0 ), limit( 0 ), settle( 0 ), moves( 10 ), walkers( 0 ), resync( false ) {}
+            options( size_t r, size_t b ) : reactors( r ), buffer( b ), order( true ), window( 0 ), limit( 0 ), settle( 0 ), moves( 10 ), walkers( 0 ), resync( false ) {}
+            options( size_t r, size_t b, bool o ) : reactors( r ), buffer( b ), order( o ), window( 0 ), limit( 0 ), settle( 0 ), moves( 10 ), walkers( 0 ), resync( false ) {}
+            options( size_t r, size_t b, bool o, size_t w, size_t l ) : reactors( r ), buffer( b ), order( o ), window( w ), limit( l ), settle( 0 ), moves( 10 ), walkers( 0 ), resync( false ) {}
+            options( size_t r, size_t b, bool o, size_t w, size_t l, size_t s ) : reactors( r ), buffer( b ), order( o ), window( w ), limit( l ), settle( s ), moves( 10 ), walkers( 0 ), resync( false ) {}
+
+            size_t reactors;    // reactor threads, directories are sharded by path
+            size_t buffer;      // inotify read buffer per reactor in bytes, 0 = default
+            bool   order;       // batches sorted by name, one message per name
+            size_t window;      // milliseconds events are held to coalesce, 0 = per read
+            size_t limit;       // messages that flush a held batch early, 0 = no limit
+            size_t settle;      // milliseconds a file must be quiet before it is sent, 0 = off
+            size_t moves;       // milliseconds a moved-from waits for its moved-to
+            size_t walkers;     // threads walking recursive queries, 0 = one per core
+            bool   resync;      // resync every directory after a queue overflow, widening its watch
+
+            dispatch::options queue;    // between the reactors and the slots
+
+            options& operator=( options const& o )
+            {
+                reactors = o.reactors;
+                buffer   = o.buffer;
+                order    = o.order;
+                window   = o.window;
+                limit    = o.limit;
+                settle   = o.settle;
+                moves    = o.moves;
+                walkers  = o.walkers;
+                resync   = o.resync;
+                queue    = o.queue;
+
+                return *this;
+            }
+        };
 
         //
-        monitor();
-        monitor( const slot_t& handler );
+        monitor( options opt = options() );
+        monitor( const slot_t& handler, options opt = options() );
         virtual ~monitor();
 
         //
         void add_directory( std::string dir, filter match = filter() );
         void del_directory( std::string dir );
+        void del_directory( std::string dir, std::string name );
 
         //
         void start();
@@ -223,26 +329,195 @@ class monitor
         //
         connection connect( const slot_t& handler );
 
+        // kernel queue overflows seen, events were lost each time
+        uint64_t overflows() const { return meter_.all.overflows.load(); }
+
+        // the dispatch queue to the slots
+        dispatch::counters queued() const { return send_.stats(); }
+
+        // counters per query and overall, to read or export
+        metrics& meters() { return meter_; }
+
     protected:
     private:
         //
-        void init ();
-        bool matches( message& m );
+        // A reactor owns one inotify descriptor and the epoll set that waits
+        // on it, every event read is routed to its query by watch descriptor.
+        // The directories below a recursive query are watched as well, each
+        // knowing only its parent's watch and its own name: a path is put
+        // together by walking up, and renaming a directory touches one node.
+        //
+        struct watch
+        {
+            watch() : mask( NONE ), parent( -1 ), count( 0 ), sum( 0 ), dir( -1 ) { counted.tv_sec = counted.tv_nsec = 0; }
+
+            uint32_t    mask;   // mask registered with the kernel
+            queryset    query;  // queries on this directory (aliased paths)
+            HANDLE      parent; // below a recursive query, the directory above
+            std::string name;   // below a recursive query, name in the parent
+            size_t      count;  // entries as last seen, for a resync
+            uint64_t    sum;    // their names' hashes added up
+            timespec    counted;// census, coarse wall clock
+            HANDLE      dir;    // a query's directory, O_PATH for fstatat()
+        };
+
+        //
+        typedef boost::unordered_map<HANDLE, watch>        registry;
+        typedef std::map<std::string, HANDLE>              pathindex;
+        typedef std::pair<HANDLE, std::string>             branch;      // parent, name
+        typedef std::map<branch, HANDLE>                   branches;    // in parent order
+
+        //
+        // Messages held back to coalesce, one batch per query. A name seen
+        // again only widens the event mask of the message already held.
+        //
+        struct hold
+        {
+            hold() : due( 0 ) {}
+
+            boost::shared_ptr<messages>            msg;
+            boost::unordered_map<uint32_t, size_t> at;      // name -> record
+            uint64_t                               due;     // flush by, monotonic ms
+        };
+
+        //
+        typedef std::map<std::string, hold> holding;
+
+        //
+        // A file still being written (settle mode), its events are merged
+        // until none has come for options::settle milliseconds
+        //
+        struct pend
+        {
+            pend() : last( 0 ) {}
+
+            record   msg;       // events so far, the name is the key
+            uint64_t last;      // latest event, monotonic ms
+        };
+
+        //
+        typedef std::pair<std::string, std::string> pendkey;    // query path, name
+        typedef std::map<pendkey, pend>              pending;
+
+        //
+        // The moved-from half of a move as one query saw it, waiting for the
+        // moved-to of the same query. Left alone it is sent to that query as
+        // deleted once it is due.
+        //
+        struct half
+        {
+            half() : hit( false ) {}
+
+            std::string name;   // old name
+            record      msg;
+            bool        hit;    // old name matched a filter
+        };
+
+        //
+        typedef std::map<std::string, half> halves;     // query path -> its half
+
+        //
+        // Every query that saw the moved-from (a directory's own, recursive
+        // ones above it) keeps its half under the cookie
+        //
+        struct move
+        {
+            move() : due( 0 ) {}
+
+            halves   from;
+            uint64_t due;       // monotonic ms
+        };
+
+        //
+        typedef std::map<uint32_t, move> moving;
+
+        //
+        struct reactor
+        {
+            reactor( size_t tick ) : fd( -1 ), ep( -1 ), ev( -1 ), size( 0 ), due( UINT64_MAX ), timer( tick ) { drained.tv_sec = drained.tv_nsec = 0; }
+
+            HANDLE          fd;     // inotify
+            HANDLE          ep;     // epoll
+            HANDLE          ev;     // eventfd, wakes the reactor on stop()
+            boost::shared_array<char>
+                            buff;   // event buffer, allocated once and reused
+            size_t          size;   // bytes in buff
+            registry        watch;  // wd -> watch
+            pathindex       index;  // path -> wd
+            branches        tree;   // (parent wd, name) -> wd, recursive queries
+            matchset::state state;  // filter scratch
+            holding         held;   // query path -> messages not yet sent
+            uint64_t        due;    // first held batch due, monotonic ms
+            pending         quiet;  // files settling
+            wheel<pending::iterator>
+                            timer;  // one timer per settling file
+            moving          moves;  // cookie -> moved-from
+            boost::shared_ptr<scanner>
+                            scan;   // new directories below recursive queries
+            timespec        drained;// queue last read empty, coarse wall clock
+            boost::mutex    lock;   // watch, index and tree against add/del_directory()
+        };
+
+        //
+        typedef boost::shared_ptr<reactor> reactor_ptr;
+        typedef std::vector<reactor_ptr>   reactors;
+
+        //
+        class survey;
+
+        //
+        void init();
+        void wake();
+        void close();
+        reactor_ptr shard( std::string const& path );
+        void add_watch( reactor_ptr r, query const& q );
+        void del_watch( reactor_ptr r, std::string const& path );
+        void ignored( reactor_ptr r, HANDLE wd );
+        uint32_t watching( query const& q ) const;
+        void census( reactor_ptr r, HANDLE wd, std::string const& path );
+        void resync( reactor_ptr r );
+        void recount( reactor_ptr r, HANDLE wd );
+        bool matches( record& m, std::string const& name, query const& q, uint32_t mask, matchset::state& st, bool nested, HANDLE at = -1, const char* base = NULL );
         bool expired( time_t tm, int sec );
-        void work( query& qry );
+        void work( reactor_ptr r );
+        void read( reactor_ptr r );
+        void keep( reactor_ptr r, query const& q, std::string const& name, record& m, std::string const& from = std::string() );
+        void route( reactor_ptr r, HANDLE wd, uint32_t mask, uint32_t cookie, const char* name );
+        void event( reactor_ptr r, query const& q, std::string const& dir, uint32_t mask, uint32_t cookie, const char* name, bool nested, HANDLE at );
+        void moved( reactor_ptr r, query const& q, std::string const& dir, uint32_t mask, uint32_t cookie, const char* name, bool nested, HANDLE at );
+        void plant( reactor_ptr r, HANDLE wd, std::string const& path );
+        void grow( reactor_ptr r, HANDLE parent, const char* name );
+        HANDLE sprout( reactor_ptr r, HANDLE parent, std::string const& name, std::string const& path );
+        void spread( reactor_ptr r, HANDLE wd, uint32_t mask );
+        void prune( reactor_ptr r, HANDLE wd );
+        bool rooted( reactor_ptr r, HANDLE wd );
+        std::string where( reactor_ptr r, HANDLE wd );
+        void unpaired( reactor_ptr r );
+        void flush( reactor_ptr r, bool all );
+        void settle( reactor_ptr r, query const& q, std::string const& name, record& m );
+        void settled( reactor_ptr r );
+        int  timeout( reactor_ptr r );
+        void deliver( messages_ptr const& msg );
         bool connected();
 
         //
         volatile bool       run_;
-        boost::mutex        mutex_;
-        HANDLE              fd_;
-        std::vector<HANDLE> wd_;
+        boost::shared_mutex mutex_; // query_ and reactor_, shared by the reactors
+        options             opt_;
+        reactors            reactor_;
         queryset            query_;
         boost::thread_group pool_;
+        boost::shared_ptr<walker>
+                            walk_;  // initial walk of recursive queries
 
         //
         signal_t            sig_;
         connection          con_;        
+        dispatcher<messages_ptr, boost::shared_ptr<messages> >
+                            send_;
+
+        //
+        metrics             meter_;    // destroyed first, its socket thread reads send_
 };
 
 //
@@ -250,49 +525,88 @@ class polling
 {
     public:
         //
-        typedef boost::signals2::connection connection;
+        typedef DIRECTORY_CONNECTION connection;
 
         //
-        struct filter
+        enum changes
         {
-            filter() : regex( "" ), name( "" ), recur( false ), size( NONE ), time( NONE ) {}
-            filter( std::string n, std::string x ) : name( n ), regex( x ), recur( false ), size( NONE ), time( NONE ) {}
-            filter( std::string n, std::string x, bool r ) : name( n ), regex( x ), recur( r ), size( NONE ), time( NONE ) {}
-            filter( std::string n, std::string x, bool r, int s, int t ) : name( n ), regex( x ), recur( false ), size( s ), time( t ) {}
+            change_none     = NONE,
+            change_added,
+            change_modified,    // size, mtime or ctime
+            change_removed,
+            change_renamed      // same (dev, ino) under a new name
+        };
 
-            std::string name;   // named identifier (registry)
-            std::string regex;  // glob expression
-            bool        recur;  // recusrive
-            int         size;   // size greater than
-            int         time;   // seconds greater than
+        //
+        struct filter
+        {
+            filter() : name( "" ), regex( "" ), recur( false ), size( NONE ), time( NONE ), syntax( matcher::syntax_glob ) {}
+            filter( std::string n, std::string x ) : name( n ), regex( x ), recur( false ), size( NONE ), time( NONE ), syntax( matcher::syntax_glob ) {}
+            filter( std::string n, std::string x, bool r ) : name( n ), regex( x ), recur( r ), size( NONE ), time( NONE ), syntax( matcher::syntax_glob ) {}
+            filter( std::string n, std::string x, bool r, int s, int t ) : name( n ), regex( x ), recur( r ), size( s ), time( t ), syntax( matcher::syntax_glob ) {}
+            filter( std::string n, std::string x, bool r, int s, int t, matcher::syntax g ) : name( n ), regex( x ), recur( r ), size( s ), time( t ), syntax( g ) {}
+
+            std::string          name;      // named identifier (registry)
+            std::string          regex;     // glob expression
+            bool                 recur;     // recusrive
+            int                  size;      // size greater than
+            int                  time;      // seconds greater than
+            enum matcher::syntax syntax;    // glob (default) or regular expression
 
             filter& operator=( filter const& f )
             {
-                name  = f.name;
-                regex = f.regex;
-                recur = f.recur;
-                size  = f.size;
-                time  = f.time;
+                name   = f.name;
+                regex  = f.regex;
+                recur  = f.recur;
+                size   = f.size;
+                time   = f.time;
+                syntax = f.syntax;
 
                 return *this;
             }
+
+            bool operator==( filter const& f ) const
+            {
+                return ( name == f.name ) && ( regex == f.regex ) && ( recur == f.recur ) &&
+                       ( size == f.size ) && ( time == f.time ) && ( syntax == f.syntax );
+            }
         };
 
+        //
+        typedef std::vector<filter> filters;
+
         //
         struct query
         {
-            query() {}
-            query( std::string p, filter m = filter(), size_t ms = 0 ) : path( p ), match( m ), wait( ms ) {}
+            query() : recur( false ), wait( 0 ), low( 0 ), high( 0 ) {}
+            query( std::string p ) : path( p ), recur( false ), wait( 0 ), low( 0 ), high( 0 ) {}
+            query( std::string p, filter m, size_t ms = 0 ) : path( p ), recur( false ), wait( ms ), low( 0 ), high( 0 ) { add( m ); }
+
+            std::string  path;
+            std::string  real;      // path resolved once (canonical), for recursive listings
+            filters      match;     // named filters
+            bool         recur;     // any filter recursive
+            matchset_ptr expr;      // compiled match[].regex (shared)
+            size_t       wait;      // interval wait milliseconds (the first, when adaptive)
+            size_t       low;       // adaptive interval bounds in milliseconds,
+            size_t       high;      // high 0 = the interval is fixed at wait
 
-            std::string path;
-            filter      match;
-            size_t      wait;   // interval wait milliseconds
+            metrics::meter_ptr meter;   // counters, shared by every copy
+
+            void add( filter const& f );
+            bool del( std::string const& name );
 
             query& operator=( query const& q )
             {
                 path  = q.path;
+                real  = q.real;
                 match = q.match;
+                recur = q.recur;
+                expr  = q.expr;
                 wait  = q.wait;
+                low   = q.low;
+                high  = q.high;
+                meter = q.meter;
 
                 return *this;
             }
@@ -307,46 +621,106 @@ class polling
         typedef std::set<query> queryset;
 
         //
-        struct message
+        struct message;
+
+        //
+        struct record
         {
-            message() : name( "" ) { memset( &stat, 0, sizeof( struct stat ) ); }
-            message( std::string n ) : name( n ) { memset( &stat, 0, sizeof( struct stat ) ); }
+            record() : dev( 0 ), ino( 0 ), size( 0 ), name( 0 ), from( 0 ), match( 0 ), change( change_none )
+            {
+                mtime.tv_sec = mtime.tv_nsec = 0;
+                ctime.tv_sec = ctime.tv_nsec = 0;
+            }
 
-            std::string name;
-            struct stat stat;
+            dev_t           dev;
+            ino_t           ino;
+            off_t           size;
+            struct timespec mtime;
+            struct timespec ctime;
+            uint32_t        name;   // offset in the batch
+            uint32_t        from;   // previous name (renamed), offset in the batch
+            uint32_t        match;  // index of the first filter matched
+            enum changes    change;
+        };
 
-            filter      match;
+        //
+        typedef batch<record, message, filter> messages;
+        typedef boost::shared_ptr<const messages> messages_ptr;
 
-            message& operator=( message const& m )
-            {
-                name  = m.name;
-                stat  = m.stat;
-                match = m.match;
+        //
+        struct message
+        {
+            message( messages const& b, record const& r );
 
-                return *this;
-            }
+            boost::string_ref name;
+            ino_t             ino;
+            off_t             size;
+            struct timespec   mtime;
 
-            bool operator<( const message& m ) const
-            {
-                return name < m.name;
-            }
+            enum changes      change;
+            boost::string_ref from;     // previous name (renamed)
+            filter const&     match;    // first filter matched
         };
 
         //
-        typedef std::set<message> messages;
+        typedef DIRECTORY_SIGNAL( messages_ptr ) signal_t;
+        typedef signal_t::slot_type slot_t;
 
         //
-        typedef boost::signals2::signal<void (messages)> signal_t;
-        typedef signal_t::slot_type slot_t;
+        // What the scans of one directory came to since start()
+        //
+        struct statistics
+        {
+            statistics() : scans( 0 ), changed( 0 ), idle( 0 ), messages( 0 ), entries( 0 ), interval( 0 ), gap( 0 ), busy( 0 ), longest( 0 ) {}
+
+            uint64_t scans;     // scans run
+            uint64_t changed;   // scans that found a change
+            uint64_t idle;      // scans since the last change
+            uint64_t messages;  // messages sent
+            size_t   entries;   // names in the last listing
+            size_t   interval;  // milliseconds to the next scan, before jitter
+            uint64_t gap;       // milliseconds between changes, a moving average
+            uint64_t busy;      // microseconds spent scanning
+            uint64_t longest;   // microseconds, the longest scan
+        };
 
         //
-        polling();
-        polling( const slot_t& handler );
+        struct options
+        {
+            options() : walkers( 0 ), meta( metadata::backend_sync ), order( true ), workers( 0 ), jitter( 10 ) {}
+            options( size_t w ) : walkers( w ), meta( metadata::backend_sync ), order( true ), workers( 0 ), jitter( 10 ) {}
+            options( size_t w, metadata::backend b ) : walkers( w ), meta( b ), order( true ), workers( 0 ), jitter( 10 ) {}
+            options( size_t w, metadata::backend b, bool o ) : walkers( w ), meta( b ), order( o ), workers( 0 ), jitter( 10 ) {}
+
+            size_t                  walkers;    // recursive scan threads, 0 = one per core
+            enum metadata::backend  meta;       // how file metadata is collected
+            bool                    order;      // batches sorted by name, one message per name
+            size_t                  workers;    // threads scanning due directories, 0 = one per core
+            size_t                  jitter;     // percent an interval is varied by, either way
+            dispatch::options       queue;      // between the workers and the slots
+
+            options& operator=( options const& o )
+            {
+                walkers = o.walkers;
+                meta    = o.meta;
+                order   = o.order;
+                workers = o.workers;
+                jitter  = o.jitter;
+                queue   = o.queue;
+
+                return *this;
+            }
+        };
+
+        //
+        polling( options opt = options() );
+        polling( const slot_t& handler, options opt = options() );
         virtual ~polling();
 
         //
-        void add_directory( std::string dir, filter match = filter(), size_t ms = 0 );
+        void add_directory( std::string dir, filter match = filter(), size_t ms = 0, size_t low = 0, size_t high = 0 );
         void del_directory( std::string dir );
+        void del_directory( std::string dir, std::string name );
 
         //
         void start();
@@ -359,26 +733,95 @@ class polling
         //
         connection connect( const slot_t& handler );
 
+        // false when the directory is not being polled
+        bool stats( std::string dir, statistics& s );
+
+        // the dispatch queue to the slots
+        dispatch::counters queued() const { return send_.stats(); }
+
+        // counters per query and overall, to read or export
+        metrics& meters() { return meter_; }
+
     protected:
     private:
         //
-        void work( query& dir );
-        void list( query dir, messages& msg );
-        bool wait( size_t ms );
+        // What the last scan saw, keyed by (dev, ino) so a rename is told
+        // apart from a remove and an add. Hard links to one inode are only
+        // tracked under the first name seen.
+        //
+        typedef std::pair<dev_t, ino_t> identity;
+
+        //
+        struct entry
+        {
+            std::string     name;
+            off_t           size;
+            struct timespec mtime;
+            struct timespec ctime;
+            uint32_t        match;
+        };
+
+        //
+        typedef boost::unordered_map<identity, entry> snapshot;
+
+        //
+        // A polled directory between scans: its query as of the last
+        // add_directory() and what the last scan saw. It is either on the
+        // timer wheel, queued, or with one worker, never two places at once.
+        //
+        struct task
+        {
+            task( query const& q ) : qry( q ), bytes( 0 ), live( true ), last( 0 ) {}
+
+            query      qry;
+            snapshot   snap;
+            size_t     bytes;   // names in the last listing, to size the next
+            bool       live;    // cleared by del_directory(), dropped when due
+            uint64_t   last;    // when a scan last found a change (monotonic)
+            statistics stat;    // stat.interval is the one in use
+        };
+
+        //
+        typedef boost::shared_ptr<task>         task_ptr;
+        typedef std::map<std::string, task_ptr> tasks;
+
+        //
+        class lister;
+
+        //
+        void schedule();
+        void work();
+        size_t pass( task& t, scanner& scan, size_t& seen );
+        void adapt( task& t, size_t sent );
+        void due( task_ptr t, size_t ms, bool first );
+        size_t list( query const& dir, scanner& scan, walker* walk, messages& msg );
+        void diff( snapshot& snap, messages const& now, messages& msg );
         bool expired( time_t tm, int sec );
-        bool matches( polling::message& m );
+        void deliver( messages_ptr const& msg );
         bool connected();
 
         //
         volatile bool             run_;
         boost::mutex              mutex_;
-        boost::condition_variable cond_;
+        boost::condition_variable cond_;    // workers, a task is ready
+        boost::condition_variable tick_;    // scheduler, the wheel changed
+        options                   opt_;
         queryset                  query_;
+        tasks                     task_;    // path -> state, while running
+        wheel<task_ptr>           timer_;   // tasks by next scan
+        std::deque<task_ptr>      ready_;   // due, waiting for a worker
+        uint64_t                  seed_;    // jitter
         boost::thread_group       pool_;
+        boost::shared_ptr<walker> walk_;    // recursive queries only
 
         //
         signal_t                  sig_;
         connection                con_;
+        dispatcher<messages_ptr, boost::shared_ptr<messages> >
+                                  send_;
+
+        //
+        metrics                   meter_;    // destroyed first, its socket thread reads send_
 };
 
 //
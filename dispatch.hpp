@@ -0,0 +1,435 @@
+//
+// dispatch.hpp
+// ~~~~~~~~~~~~~~~~~~~~~
+//
+// Copyright (c) 2004-2012 Metasystems Technologies Inc. (MTI)
+// All rights reserved
+//
+// Distributed under the MTI Software License, Version 0.1.
+//
+// as defined by accompanying file MTI-LICENSE-0.1.info or
+// at http://www.mtihq.com/license/MTI-LICENSE-0.1.info
+//
+
+#ifndef __DISPATCH_HPP
+#define __DISPATCH_HPP
+
+// c
+#include <stdint.h>
+
+// c++
+#include <algorithm>
+
+// boost
+#include <boost/bind.hpp>
+#include <boost/atomic.hpp>
+#include <boost/thread.hpp>
+#include <boost/function.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/lockfree/queue.hpp>
+
+// local
+
+//
+namespace mti { namespace audit { namespace shield {
+
+//
+namespace directory {
+
+//
+// What a dispatcher is set up with and what it counts, the same for every
+// kind of item it carries
+//
+class dispatch
+{
+    public:
+        //
+        // what a producer does when the queue is full ...
+        //
+        //  o> policy_block     waits for room, the reader stalls as before
+        //  o> policy_drop      drops the oldest queued item to make room
+        //  o> policy_coalesce  merges into one held item, queued in order
+        //                      as soon as there is room
+        //
+        enum policy
+        {
+            policy_block,
+            policy_drop,
+            policy_coalesce
+        };
+
+        //
+        struct options
+        {
+            options() : size( 1024 ), threads( 1 ), policy( policy_block ) {}
+            options( size_t s ) : size( s ), threads( 1 ), policy( policy_block ) {}
+            options( size_t s, size_t t ) : size( s ), threads( t ), policy( policy_block ) {}
+            options( size_t s, size_t t, enum policy p ) : size( s ), threads( t ), policy( p ) {}
+
+            size_t      size;       // items queued at most, 0 = no queue, slots run on the reader
+            size_t      threads;    // threads running the slots, 1 keeps items in order
+            enum policy policy;     // when full
+
+            options& operator=( options const& o )
+            {
+                size    = o.size;
+                threads = o.threads;
+                policy  = o.policy;
+
+                return *this;
+            }
+        };
+
+        //
+        struct counters
+        {
+            counters() : depth( 0 ), peak( 0 ), pushed( 0 ), sent( 0 ), dropped( 0 ), coalesced( 0 ), blocked( 0 ) {}
+
+            size_t   depth;         // queued now
+            size_t   peak;          // most ever queued
+            uint64_t pushed;        // items handed in
+            uint64_t sent;          // items handed to the slots
+            uint64_t dropped;       // oldest items dropped (policy_drop)
+            uint64_t coalesced;     // items merged into the held one (policy_coalesce)
+            uint64_t blocked;       // pushes that had to wait (policy_block)
+        };
+};
+
+//
+// A bounded queue between the threads producing items and those running the
+// slots. Producers push onto a lock-free queue of fixed capacity, any number
+// of them at once; the dispatch threads pop and deliver. Only the slow
+// paths take a lock: a dispatch thread going to sleep on an empty queue, a
+// producer waiting for room, and the item held aside when coalescing.
+//
+// Items are copied (shared_ptr's in practice). stop() delivers whatever is
+// still queued before it returns.
+//
+// The held item is an H, built up in place: merge adds each item to it and
+// seal turns it into an M once, when it is queued. For a shared batch H is
+// the batch still writable and M the same batch made const.
+//
+template <class M, class H = M>
+class dispatcher : public dispatch, private boost::noncopyable
+{
+    public:
+        //
+        typedef boost::function<void (M const&)>         deliver_t;
+        typedef boost::function<void (H&, M const&)>     merge_t;     // into the held item
+        typedef boost::function<M (H&)>                  seal_t;      // the held item, as queued
+
+        //
+        dispatcher( options const& opt, deliver_t const& deliver, merge_t const& merge = merge_t(), seal_t const& seal = seal_t() )
+            : run_( false ),
+              opt_( opt ),
+              deliver_( deliver ),
+              merge_( merge ),
+              seal_( seal ),
+              queue_( std::max( opt.size, (size_t)1 ) ),
+              depth_( 0 ),
+              peak_( 0 ),
+              pushed_( 0 ),
+              sent_( 0 ),
+              dropped_( 0 ),
+              coalesced_( 0 ),
+              blocked_( 0 ),
+              sleep_( 0 ),
+              wait_( 0 ),
+              held_( false )
+        {
+            if ( ( opt_.policy == policy_coalesce ) && ( ( ! merge_ ) || ( ! seal_ ) ) )
+                opt_.policy = policy_drop;
+        }
+
+        //
+        virtual ~dispatcher() { stop(); }
+
+        //
+        void start()
+        {
+            if ( ( run_ ) || ( opt_.size == 0 ) )
+                return;
+
+            run_ = true;
+
+            for ( size_t i = 0; i < std::max( opt_.threads, (size_t)1 ); ++i )
+                pool_.create_thread( boost::bind( &dispatcher::work, this ) );
+        }
+
+        //
+        void stop()
+        {
+            if ( ! run_ )
+                return;
+
+            {
+                boost::mutex::scoped_lock lock( mutex_ );
+
+                run_ = false;
+
+                ready_.notify_all();
+                room_.notify_all();
+            }
+
+            pool_.join_all();
+        }
+
+        //
+        void push( M const& m )
+        {
+            ++pushed_;
+
+            // no queue, or not (or no longer) running
+            if ( ! run_ )
+            {
+                deliver( m );
+                return;
+            }
+
+            if ( opt_.policy == policy_coalesce )
+                coalesce( m );
+            else
+            {
+                M* p = new M( m );
+
+                while ( ! queue_.bounded_push( p ) )
+                {
+                    if ( ! full( p ) )
+                        return;
+                }
+
+                queued();
+            }
+        }
+
+        //
+        counters stats() const
+        {
+            counters c;
+
+            c.depth     = depth_.load();
+            c.peak      = peak_.load();
+            c.pushed    = pushed_.load();
+            c.sent      = sent_.load();
+            c.dropped   = dropped_.load();
+            c.coalesced = coalesced_.load();
+            c.blocked   = blocked_.load();
+
+            return c;
+        }
+
+    protected:
+    private:
+        //
+        // The queue is full and p is not on it. Returns false once p has been
+        // dealt with otherwise, true to try again.
+        //
+        bool full( M* p )
+        {
+            if ( opt_.policy == policy_drop )
+            {
+                M* o;
+
+                if ( queue_.pop( o ) )
+                {
+                    --depth_;
+                    ++dropped_;
+
+                    delete o;
+                }
+
+                return true;
+            }
+
+            // policy_block
+            boost::mutex::scoped_lock lock( mutex_ );
+
+            bool in = false;
+
+            ++blocked_;
+            ++wait_;
+
+            while ( ( run_ ) && ( ! ( in = queue_.bounded_push( p ) ) ) )
+                room_.timed_wait( lock, boost::posix_time::milliseconds( 10 ) );
+
+            --wait_;
+
+            // stopped while waiting, the caller's thread delivers
+            if ( ! in )
+            {
+                lock.unlock();
+
+                deliver( *p );
+                delete p;
+
+                return false;
+            }
+
+            lock.unlock();
+            queued();
+
+            return false;
+        }
+
+        //
+        // Once anything is held, what follows is merged into it so the order
+        // of items is kept; the held item is queued as soon as there is room.
+        //
+        void coalesce( M const& m )
+        {
+            if ( ! held_ )
+            {
+                M* p = new M( m );
+
+                if ( queue_.bounded_push( p ) )
+                {
+                    queued();
+                    return;
+                }
+
+                delete p;
+            }
+
+            boost::mutex::scoped_lock lock( keep_ );
+
+            if ( held_ )
+                ++coalesced_;
+
+            merge_( hold_, m );
+            held_ = true;
+
+            release();
+        }
+
+        //
+        // Seal and queue the held item if there is room now, a full queue is
+        // not worth sealing for. Should a producer take the last room first
+        // the item stays held, and is merged into and sealed again. Called
+        // with keep_ held.
+        //
+        void release()
+        {
+            if ( ( ! held_ ) || ( depth_.load() >= opt_.size ) )
+                return;
+
+            M* p = new M( seal_( hold_ ) );
+
+            if ( ! queue_.bounded_push( p ) )
+            {
+                delete p;
+                return;
+            }
+
+            hold_ = H();
+            held_ = false;
+
+            queued();
+        }
+
+        //
+        void queued()
+        {
+            size_t d = ++depth_;
+            size_t p = peak_.load();
+
+            while ( ( d > p ) && ( ! peak_.compare_exchange_weak( p, d ) ) )
+                ;
+
+            // a dispatch thread may be asleep, the lock orders this against
+            // its last look at the queue
+            if ( sleep_.load() > 0 )
+            {
+                boost::mutex::scoped_lock lock( mutex_ );
+                ready_.notify_one();
+            }
+        }
+
+        //
+        void work()
+        {
+            for ( ;; )
+            {
+                M* p;
+
+                if ( ! queue_.pop( p ) )
+                {
+                    boost::mutex::scoped_lock lock( mutex_ );
+
+                    ++sleep_;
+
+                    while ( ( run_ ) && ( queue_.empty() ) && ( ! held_ ) )
+                        ready_.timed_wait( lock, boost::posix_time::milliseconds( 100 ) );
+
+                    --sleep_;
+
+                    if ( ( ! run_ ) && ( queue_.empty() ) && ( ! held_ ) )
+                        break;
+
+                    lock.unlock();
+
+                    if ( held_ )
+                    {
+                        boost::mutex::scoped_lock lock( keep_ );
+                        release();
+                    }
+
+                    continue;
+                }
+
+                --depth_;
+
+                // room for a waiting producer, or for the held item
+                if ( wait_.load() > 0 )
+                {
+                    boost::mutex::scoped_lock lock( mutex_ );
+                    room_.notify_one();
+                }
+
+                if ( held_ )
+                {
+                    boost::mutex::scoped_lock lock( keep_ );
+                    release();
+                }
+
+                deliver( *p );
+                delete p;
+            }
+        }
+
+        //
+        void deliver( M const& m )
+        {
+            ++sent_;
+            deliver_( m );
+        }
+
+        //
+        volatile bool               run_;
+        options                     opt_;
+        deliver_t                   deliver_;
+        merge_t                     merge_;
+        seal_t                      seal_;
+        boost::lockfree::queue<M*>  queue_;
+        boost::atomic<size_t>       depth_;
+        boost::atomic<size_t>       peak_;
+        boost::atomic<uint64_t>     pushed_;
+        boost::atomic<uint64_t>     sent_;
+        boost::atomic<uint64_t>     dropped_;
+        boost::atomic<uint64_t>     coalesced_;
+        boost::atomic<uint64_t>     blocked_;
+        boost::atomic<size_t>       sleep_;     // dispatch threads asleep
+        boost::atomic<size_t>       wait_;      // producers waiting for room
+        boost::mutex                mutex_;     // sleeping and waiting
+        boost::condition_variable   ready_;     // dispatch threads, an item was queued
+        boost::condition_variable   room_;      // producers, an item was taken
+        boost::mutex                keep_;      // the held item
+        boost::atomic<bool>         held_;
+        H                           hold_;
+        boost::thread_group         pool_;
+};
+
+}   // namespace mti::audit::shield::directory
+
+}}} // namespace mti::audit::shield
+
+#endif // __DISPATCH_HPP
@@ -0,0 +1,264 @@
+//
+// fanout.hpp
+// ~~~~~~~~~~~~~~~~~~~~~
+//
+// Copyright (c) 2004-2012 Metasystems Technologies Inc. (MTI)
+// All rights reserved
+//
+// Distributed under the MTI Software License, Version 0.1.
+//
+// as defined by accompanying file MTI-LICENSE-0.1.info or
+// at http://www.mtihq.com/license/MTI-LICENSE-0.1.info
+//
+
+#ifndef __FANOUT_HPP
+#define __FANOUT_HPP
+
+// c
+#include <stdint.h>
+
+// c++
+#include <vector>
+
+// boost
+#include <boost/atomic.hpp>
+#include <boost/thread.hpp>
+#include <boost/function.hpp>
+#include <boost/weak_ptr.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/noncopyable.hpp>
+
+// local
+
+//
+namespace mti { namespace audit { namespace shield {
+
+//
+namespace directory {
+
+//
+// What a connection needs of the slot list it came from, whatever it calls
+//
+class fanout_base
+{
+    public:
+        //
+        class core
+        {
+            public:
+                virtual ~core() {}
+                virtual void cut( uint64_t id ) = 0;
+                virtual bool has( uint64_t id ) const = 0;
+        };
+
+        //
+        // One connected slot, disconnect() is safe from any thread, from the
+        // slot itself, and after the fanout is gone
+        //
+        class connection
+        {
+            public:
+                connection() : id_( 0 ) {}
+                connection( boost::shared_ptr<core> const& c, uint64_t id ) : core_( c ), id_( id ) {}
+
+                void disconnect() const
+                {
+                    boost::shared_ptr<core> c( core_.lock() );
+
+                    if ( c )
+                        c->cut( id_ );
+                }
+
+                bool connected() const
+                {
+                    boost::shared_ptr<core> c( core_.lock() );
+
+                    return ( c ) && ( c->has( id_ ) );
+                }
+
+            private:
+                boost::weak_ptr<core> core_;
+                uint64_t              id_;
+        };
+};
+
+//
+// A signal for the one signature used here, void ( A ), with the slots kept
+// as a copy-on-write list. connect() and disconnect() build a new list under
+// a mutex and publish it with one atomic store; an emit loads the current
+// list and calls down it without taking any lock. A list replaced while
+// emits may still be walking it is kept until no emit is under way at the
+// next change (or at destruction), an RCU grace period in all but name.
+//
+// As with boost::signals2, a slot disconnected during an emit is not called
+// after disconnect() returns, other than by an emit already inside it. There
+// is no slot tracking, groups or combiner.
+//
+template <class A>
+class fanout : public fanout_base, private boost::noncopyable
+{
+    public:
+        //
+        typedef boost::function<void (A)> slot_type;
+        typedef void                      result_type;
+
+        //
+        fanout() : core_( new state() ) {}
+        virtual ~fanout() { disconnect_all_slots(); }
+
+        //
+        connection connect( slot_type const& fn )
+        {
+            return connection( core_, core_->add( fn ) );
+        }
+
+        //
+        void operator()( A a ) const
+        {
+            emit        e( *core_ );
+            list const* l = core_->head.load();
+
+            for ( typename list::const_iterator i = l->begin(); i != l->end(); ++i )
+            {
+                if ( (*i)->on.load( boost::memory_order_acquire ) )
+                    (*i)->fn( a );
+            }
+        }
+
+        //
+        bool empty() const { return core_->size.load() == 0; }
+        size_t num_slots() const { return core_->size.load(); }
+
+        //
+        void disconnect_all_slots() { core_->cut( 0 ); }
+
+    protected:
+    private:
+        //
+        struct slot
+        {
+            slot( uint64_t i, slot_type const& f ) : id( i ), fn( f ), on( true ) {}
+
+            uint64_t            id;
+            slot_type           fn;
+            boost::atomic<bool> on;
+        };
+
+        //
+        typedef boost::shared_ptr<slot> slot_ptr;
+        typedef std::vector<slot_ptr>   list;
+
+        //
+        class state : public core
+        {
+            public:
+                state() : head( new list() ), active( 0 ), size( 0 ), next( 1 ) {}
+
+                virtual ~state()
+                {
+                    delete head.load();
+
+                    for ( size_t i = 0; i < retired.size(); ++i )
+                        delete retired[ i ];
+                }
+
+                //
+                uint64_t add( slot_type const& fn )
+                {
+                    boost::mutex::scoped_lock lock( mutex );
+
+                    list* l = new list( *head.load() );
+
+                    l->push_back( slot_ptr( new slot( next, fn ) ) );
+                    publish( l );
+
+                    return next++;
+                }
+
+                //
+                // id 0 is every slot
+                //
+                virtual void cut( uint64_t id )
+                {
+                    boost::mutex::scoped_lock lock( mutex );
+
+                    list const* o = head.load();
+                    list*       l = new list();
+
+                    l->reserve( o->size() );
+
+                    for ( typename list::const_iterator i = o->begin(); i != o->end(); ++i )
+                    {
+                        if ( ( id == 0 ) || ( (*i)->id == id ) )
+                            (*i)->on.store( false, boost::memory_order_release );
+                        else
+                            l->push_back( *i );
+                    }
+
+                    publish( l );
+                }
+
+                //
+                virtual bool has( uint64_t id ) const
+                {
+                    boost::mutex::scoped_lock lock( mutex );
+
+                    list const* l = head.load();
+
+                    for ( typename list::const_iterator i = l->begin(); i != l->end(); ++i )
+                    {
+                        if ( (*i)->id == id )
+                            return true;
+                    }
+
+                    return false;
+                }
+
+                //
+                // Swap the list in, and free the old ones once no emit can
+                // still be on them. An emit that counted itself in after
+                // active was seen at 0 loads the new list.
+                //
+                void publish( list* l )
+                {
+                    retired.push_back( head.exchange( l ) );
+                    size = l->size();
+
+                    if ( active.load() > 0 )
+                        return;
+
+                    for ( size_t i = 0; i < retired.size(); ++i )
+                        delete retired[ i ];
+
+                    retired.clear();
+                }
+
+                //
+                boost::atomic<list*>    head;
+                boost::atomic<size_t>   active;     // emits under way
+                boost::atomic<size_t>   size;
+                uint64_t                next;       // slot id
+                std::vector<list*>      retired;    // replaced, maybe still walked
+                mutable boost::mutex    mutex;      // writers
+        };
+
+        //
+        // counts an emit in and out, a slot may throw
+        //
+        struct emit
+        {
+            emit( state& s ) : s_( s ) { ++s_.active; }
+            ~emit() { --s_.active; }
+
+            state& s_;
+        };
+
+        //
+        boost::shared_ptr<state> core_;
+};
+
+}   // namespace mti::audit::shield::directory
+
+}}} // namespace mti::audit::shield
+
+#endif // __FANOUT_HPP
@@ -47,11 +47,11 @@ class test_moniker
     protected:
     private:
         //
-        void handler_monitor( mti::audit::shield::directory::monitor::messages msg )
+        void handler_monitor( mti::audit::shield::directory::monitor::messages_ptr msg )
         {
             typedef mti::audit::shield::directory::monitor::messages::iterator iter;
 
-            for ( iter m = msg.begin(); m != msg.end(); ++m )
+            for ( iter m = msg->begin(); m != msg->end(); ++m )
             {
                 std::cout << "Moniker (events): " << (*m).name 
                           << " ; event: " << (*m).match.event 
@@ -60,13 +60,14 @@ class test_moniker
         }
 
         //
-        void handler_polling( mti::audit::shield::directory::polling::messages msg )
+        void handler_polling( mti::audit::shield::directory::polling::messages_ptr msg )
         {
             typedef mti::audit::shield::directory::polling::messages::iterator iter;
 
-            for ( iter m = msg.begin(); m != msg.end(); ++m )
+            for ( iter m = msg->begin(); m != msg->end(); ++m )
             {
                 std::cout << "Moniker (polled): " << (*m).name 
+                          << " ; change: " << (*m).change
                           << std::endl;
             }
         }
@@ -0,0 +1,577 @@
+//
+// match.cpp
+// ~~~~~~~~~~~~~~~~~~~~~
+//
+// Copyright (c) 2004-2012 Metasystems Technologies Inc. (MTI)
+// All rights reserved
+//
+// Distributed under the MTI Software License, Version 0.1.
+//
+// as defined by accompanying file MTI-LICENSE-0.1.info or
+// at http://www.mtihq.com/license/MTI-LICENSE-0.1.info
+//
+
+// c
+#include <string.h>
+
+// c++
+#include <stdexcept>
+
+// boost
+
+// local
+#include "match.hpp"
+
+//
+namespace mti { namespace audit { namespace shield {
+
+//
+namespace directory {
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// class matcher
+//
+////////////////////////////////////////////////////////////////////////////////
+
+matcher::matcher( std::string const& expr, matcher::syntax s /*= matcher::syntax_glob*/ )
+    : expr_( expr ),
+      syntax_( s ),
+      shape_( shape_any )
+{
+    compile();
+}
+
+//
+matcher::~matcher()
+{
+}
+
+//
+bool matcher::matches( std::string const& path ) const
+{
+    return matches( path.c_str(), path.length() );
+}
+
+//
+bool matcher::matches( const char* path, size_t len ) const
+{
+    if ( shape_ == shape_any )
+        return true;
+
+    if ( shape_ == shape_regex )
+        return boost::regex_search( path, path + len, regex_ );
+
+    // globs only ever look at the file name
+    const char* name = static_cast<const char*>( ::memrchr( path, '/', len ) );
+
+    if ( name )
+    {
+        len -= ( name + 1 - path );
+        name++;
+    }
+    else
+        name = path;
+
+    switch ( shape_ )
+    {
+        case shape_literal:
+            return ( len == lead_.length() ) && ( ::memcmp( name, lead_.data(), len ) == 0 );
+
+        case shape_prefix:
+            return ( len >= lead_.length() ) && ( ::memcmp( name, lead_.data(), lead_.length() ) == 0 );
+
+        case shape_suffix:
+            return ( len >= tail_.length() ) && ( ::memcmp( name + len - tail_.length(), tail_.data(), tail_.length() ) == 0 );
+
+        case shape_affix:
+            return ( len >= lead_.length() + tail_.length() )
+                && ( ::memcmp( name, lead_.data(), lead_.length() ) == 0 )
+                && ( ::memcmp( name + len - tail_.length(), tail_.data(), tail_.length() ) == 0 );
+
+        default:
+            return wildcard( name, len );
+    }
+}
+
+//
+void matcher::compile()
+{
+    if ( expr_.length() == 0 )
+        return;
+
+    //
+    if ( syntax_ == syntax_regex )
+    {
+        try
+        {
+            regex_.assign( expr_ );
+            shape_ = shape_regex;
+        }
+        catch ( boost::regex_error const& )
+        {
+            throw std::invalid_argument( "matcher: " + expr_ + " is not a valid expression" );
+        }
+
+        return;
+    }
+
+    //
+    size_t i = 0;
+    bool   wild = false;    // ? or [...] seen
+
+    while ( i < expr_.length() )
+    {
+        unsigned char c = expr_[ i++ ];
+
+        if ( c == '*' )
+        {
+            // collapse runs of stars
+            if ( token_.empty() || ( token_.back().type != token::kind_star ) )
+                token_.push_back( token( token::kind_star ) );
+        }
+        else if ( c == '?' )
+        {
+            token_.push_back( token( token::kind_any ) );
+            wild = true;
+        }
+        else if ( c == '[' )
+        {
+            token t( token::kind_class );
+            bool  neg = false;
+            bool  end = false;
+            size_t j  = i;
+
+            if ( ( j < expr_.length() ) && ( ( expr_[ j ] == '!' ) || ( expr_[ j ] == '^' ) ) )
+            {
+                neg = true;
+                j++;
+            }
+
+            // a leading "]" is a member, not the end of the class
+            for ( bool first = true; j < expr_.length(); first = false )
+            {
+                unsigned char lo = expr_[ j++ ];
+                unsigned char hi;
+
+                if ( ( lo == ']' ) && ( ! first ) )
+                {
+                    end = true;
+                    break;
+                }
+
+                if ( ( lo == '\\' ) && ( j < expr_.length() ) )
+                    lo = expr_[ j++ ];
+
+                hi = lo;
+
+                if ( ( j + 1 < expr_.length() ) && ( expr_[ j ] == '-' ) && ( expr_[ j + 1 ] != ']' ) )
+                {
+                    hi = expr_[ j + 1 ];
+                    j += 2;
+                }
+
+                for ( unsigned int x = lo; x <= hi; ++x )
+                    t.set[ x >> 6 ] |= ( (uint64_t)1 << ( x & 63 ) );
+            }
+
+            if ( ! end )
+                throw std::invalid_argument( "matcher: " + expr_ + " is not a valid expression" );
+
+            if ( neg )
+            {
+                for ( int w = 0; w < 4; ++w )
+                    t.set[ w ] = ~t.set[ w ];
+            }
+
+            token_.push_back( t );
+            wild = true;
+            i = j;
+        }
+        else
+        {
+            if ( ( c == '\\' ) && ( i < expr_.length() ) )
+                c = expr_[ i++ ];
+
+            token_.push_back( token( token::kind_char, c ) );
+        }
+    }
+
+    //
+    if ( wild )
+    {
+        shape_ = shape_wildcard;
+        return;
+    }
+
+    // only literal characters and stars are left, find the stars
+    size_t stars = 0, star = 0;
+
+    for ( size_t t = 0; t < token_.size(); ++t )
+    {
+        if ( token_[ t ].type == token::kind_star )
+        {
+            stars++;
+            star = t;
+        }
+    }
+
+    if ( stars > 1 )
+    {
+        shape_ = shape_wildcard;
+        return;
+    }
+
+    if ( stars == 0 )
+        star = token_.size();
+
+    for ( size_t t = 0; t < star; ++t )
+        lead_ += token_[ t ].chr;
+
+    for ( size_t t = star + 1; t < token_.size(); ++t )
+        tail_ += token_[ t ].chr;
+
+    if ( stars == 0 )
+        shape_ = shape_literal;
+    else if ( token_.size() == 1 )
+        shape_ = shape_any;
+    else if ( lead_.empty() )
+        shape_ = shape_suffix;
+    else if ( tail_.empty() )
+        shape_ = shape_prefix;
+    else
+        shape_ = shape_affix;
+}
+
+//
+// Single pass glob match, backtracking only to the most recent star
+//
+bool matcher::wildcard( const char* name, size_t len ) const
+{
+    size_t t = 0, i = 0;
+    size_t st = std::string::npos, si = 0;
+
+    while ( i < len )
+    {
+        if ( ( t < token_.size() ) && ( token_[ t ].type == token::kind_star ) )
+        {
+            st = t++;
+            si = i;
+        }
+        else if ( ( t < token_.size() ) && ( token_[ t ].accepts( name[ i ] ) ) )
+        {
+            t++;
+            i++;
+        }
+        else if ( st != std::string::npos )
+        {
+            t = st + 1;
+            i = ++si;
+        }
+        else
+            return false;
+    }
+
+    while ( ( t < token_.size() ) && ( token_[ t ].type == token::kind_star ) )
+        t++;
+
+    return ( t == token_.size() );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// class matchset
+//
+////////////////////////////////////////////////////////////////////////////////
+
+matchset::matchset( matchers const& m )
+    : match_( m ),
+      engine_( m.size(), engine_self ),
+      glob_( m.size(), std::string::npos ),
+      words_( 0 )
+{
+    compile();
+}
+
+//
+matchset::~matchset()
+{
+}
+
+//
+bool matchset::matches( std::string const& path, matchset::state& s ) const
+{
+    return matches( path.c_str(), path.length(), s );
+}
+
+//
+bool matchset::matches( const char* path, size_t len, matchset::state& s ) const
+{
+    s.hit_.assign( ( match_.size() + 63 ) / 64, 0 );
+
+    // one expression, nothing to combine
+    if ( match_.size() == 1 )
+    {
+        if ( match_[ 0 ]->matches( path, len ) )
+            set( s, 0 );
+
+        return s.hit_[ 0 ] != 0;
+    }
+
+    //
+    const char* name = static_cast<const char*>( ::memrchr( path, '/', len ) );
+    size_t      n    = len;
+
+    if ( name )
+    {
+        n -= ( name + 1 - path );
+        name++;
+    }
+    else
+        name = path;
+
+    // heads: literal, prefix and affix
+    if ( lead_.size() > 1 )
+    {
+        uint32_t at = 0;
+
+        for ( size_t i = 0; ( i < n ) && ( ( at = lead_[ at ].find( name[ i ] ) ) != 0 ); ++i )
+        {
+            std::vector<uint32_t> const& term = lead_[ at ].term;
+
+            for ( size_t t = 0; t < term.size(); ++t )
+            {
+                matcher const& m = *( match_[ term[ t ] ] );
+
+                switch ( m.form() )
+                {
+                    case matcher::shape_literal:
+                        if ( i + 1 == n )
+                            set( s, term[ t ] );
+                        break;
+
+                    case matcher::shape_prefix:
+                        set( s, term[ t ] );
+                        break;
+
+                    default:
+                        if ( ( n >= m.lead_.length() + m.tail_.length() ) &&
+                             ( ::memcmp( name + n - m.tail_.length(), m.tail_.data(), m.tail_.length() ) == 0 ) )
+                            set( s, term[ t ] );
+                        break;
+                }
+            }
+        }
+    }
+
+    // tails: suffix
+    if ( tail_.size() > 1 )
+    {
+        uint32_t at = 0;
+
+        for ( size_t i = n; ( i > 0 ) && ( ( at = tail_[ at ].find( name[ i - 1 ] ) ) != 0 ); --i )
+        {
+            std::vector<uint32_t> const& term = tail_[ at ].term;
+
+            for ( size_t t = 0; t < term.size(); ++t )
+                set( s, term[ t ] );
+        }
+    }
+
+    // everything else that is a glob
+    if ( words_ > 0 )
+    {
+        size_t lo = 0, hi = words_ - 1;
+        bool   live = true;
+
+        s.cur_ = init_;
+
+        for ( size_t i = 0; ( i < n ) && ( live ); ++i )
+        {
+            step( s.cur_, lo, hi, name[ i ] );
+
+            // only the words still holding live positions are stepped
+            while ( ( lo <= hi ) && ( s.cur_[ lo ] == 0 ) )
+                lo++;
+
+            while ( ( hi > lo ) && ( s.cur_[ hi ] == 0 ) )
+                hi--;
+
+            live = ( lo <= hi ) && ( s.cur_[ hi ] != 0 );
+        }
+
+        for ( size_t i = 0; ( i < match_.size() ) && ( live ); ++i )
+        {
+            size_t b = glob_[ i ];
+
+            if ( ( engine_[ i ] == engine_auto ) && ( ( s.cur_[ b >> 6 ] >> ( b & 63 ) ) & 1 ) )
+                set( s, i );
+        }
+    }
+
+    // and what could not be merged
+    for ( size_t i = 0; i < match_.size(); ++i )
+    {
+        if ( ( engine_[ i ] == engine_self ) && ( match_[ i ]->matches( path, len ) ) )
+            set( s, i );
+    }
+
+    //
+    for ( size_t w = 0; w < s.hit_.size(); ++w )
+    {
+        if ( s.hit_[ w ] != 0 )
+            return true;
+    }
+
+    return false;
+}
+
+//
+void matchset::compile()
+{
+    size_t bits = 0;
+
+    if ( match_.size() < 2 )
+        return;
+
+    lead_.resize( 1 );
+    tail_.resize( 1 );
+
+    for ( size_t i = 0; i < match_.size(); ++i )
+    {
+        matcher const& m = *( match_[ i ] );
+
+        switch ( m.form() )
+        {
+            case matcher::shape_literal:
+            case matcher::shape_prefix:
+            case matcher::shape_affix:
+                insert( lead_, m.lead_, false, i );
+                engine_[ i ] = engine_lead;
+                break;
+
+            case matcher::shape_suffix:
+                insert( tail_, m.tail_, true, i );
+                engine_[ i ] = engine_tail;
+                break;
+
+            case matcher::shape_wildcard:
+                bits += m.token_.size() + 1;
+                engine_[ i ] = engine_auto;
+                break;
+
+            default:
+                break;
+        }
+    }
+
+    if ( bits == 0 )
+        return;
+
+    //
+    // Lay the globs out side by side, a start bit followed by one bit per
+    // token, bit k meaning "the first k tokens matched"
+    //
+    words_ = ( bits + 63 ) / 64;
+
+    init_.assign( words_, 0 );
+    self_.assign( words_, 0 );
+    eps_.assign( words_, 0 );
+    char_.assign( 256 * words_, 0 );
+
+    size_t b = 0;
+
+    for ( size_t i = 0; i < match_.size(); ++i )
+    {
+        matcher const& m = *( match_[ i ] );
+
+        if ( engine_[ i ] != engine_auto )
+            continue;
+
+        //
+        init_[ b >> 6 ] |= ( (uint64_t)1 << ( b & 63 ) );
+
+        for ( size_t t = 0; t < m.token_.size(); ++t )
+        {
+            matcher::token const& k   = m.token_[ t ];
+            size_t                p   = b + t + 1;
+            uint64_t              bit = ( (uint64_t)1 << ( p & 63 ) );
+
+            if ( k.type == matcher::token::kind_star )
+            {
+                self_[ p >> 6 ] |= bit;
+                eps_[ p >> 6 ]  |= bit;
+            }
+            else
+            {
+                for ( unsigned int c = 0; c < 256; ++c )
+                {
+                    if ( k.accepts( c ) )
+                        char_[ c * words_ + ( p >> 6 ) ] |= bit;
+                }
+            }
+        }
+
+        b += m.token_.size();
+        glob_[ i ] = b++;
+    }
+
+    // a leading star is entered before the first character
+    for ( size_t w = 0; w < words_; ++w )
+        init_[ w ] |= ( ( init_[ w ] << 1 ) | ( w > 0 ? init_[ w - 1 ] >> 63 : 0 ) ) & eps_[ w ];
+}
+
+//
+void matchset::insert( matchset::trie& t, std::string const& key, bool reverse, uint32_t expr )
+{
+    uint32_t at = 0;
+
+    for ( size_t i = 0; i < key.length(); ++i )
+    {
+        unsigned char c    = key[ reverse ? key.length() - 1 - i : i ];
+        uint32_t      next = t[ at ].find( c );
+
+        if ( next == 0 )
+        {
+            next = t.size();
+            t[ at ].next.push_back( node::edge( c, next ) );
+            t.push_back( node() );
+        }
+
+        at = next;
+    }
+
+    t[ at ].term.push_back( expr );
+}
+
+//
+// s = ( ( s << 1 ) & char[ c ] ) | ( s & self ), then close over the stars.
+// Done in place over the live words [ lo, hi ], which may grow by one.
+//
+void matchset::step( matchset::bitmap& s, size_t lo, size_t& hi, unsigned char c ) const
+{
+    const uint64_t* chr   = &char_[ c * words_ ];
+    uint64_t        carry = 0;
+
+    if ( hi + 1 < words_ )
+        hi++;
+
+    // high to low, so s[ w - 1 ] still holds the previous state
+    for ( size_t w = hi + 1; w-- > lo; )
+    {
+        uint64_t prev = ( w > 0 ) ? s[ w - 1 ] : 0;
+
+        s[ w ] = ( ( ( s[ w ] << 1 ) | ( prev >> 63 ) ) & chr[ w ] ) | ( s[ w ] & self_[ w ] );
+    }
+
+    // runs of stars are collapsed, so one closing pass is enough
+    for ( size_t w = lo; w <= hi; ++w )
+    {
+        s[ w ] |= ( ( s[ w ] << 1 ) | carry ) & eps_[ w ];
+        carry = s[ w ] >> 63;
+    }
+}
+
+}   // namespace mti::audit::shield::directory
+
+}}} // namespace mti::audit::shield
@@ -0,0 +1,265 @@
+//
+// match.hpp
+// ~~~~~~~~~~~~~~~~~~~~~
+//
+// Copyright (c) 2004-2012 Metasystems Technologies Inc. (MTI)
+// All rights reserved
+//
+// Distributed under the MTI Software License, Version 0.1.
+//
+// as defined by accompanying file MTI-LICENSE-0.1.info or
+// at http://www.mtihq.com/license/MTI-LICENSE-0.1.info
+//
+
+#ifndef __MATCH_HPP
+#define __MATCH_HPP
+
+// c
+#include <stdint.h>
+
+// c++
+#include <string>
+#include <vector>
+
+// boost
+#include <boost/regex.hpp>
+#include <boost/shared_ptr.hpp>
+
+// local
+
+//
+namespace mti { namespace audit { namespace shield {
+
+//
+namespace directory {
+
+//
+// A filter expression compiled once, when the directory is added, and then
+// shared (read only) by every event evaluated against it.
+//
+// Glob expressions (the default) are matched against the file name only,
+// supporting "*", "?", "[...]" (with "!" or "^" negation) and "\" escapes.
+// The expression is classified when compiled, so the common shapes ...
+//
+//  o> literal     "name.dat"
+//  o> prefix      "audit_*"
+//  o> suffix      "*.log"
+//  o> affix       "audit_*.dat"
+//
+// ... are a length check and one or two memcmp()s, anything else runs the
+// wildcard engine over the compiled tokens. Neither allocates.
+//
+// Regular expressions are opt-in and keep the original behavior, searched
+// (boost::regex_search) anywhere in the full path.
+//
+class matcher
+{
+    public:
+        //
+        enum syntax
+        {
+            syntax_glob,
+            syntax_regex
+        };
+
+        //
+        enum shape
+        {
+            shape_any,          // empty or "*"
+            shape_literal,
+            shape_prefix,
+            shape_suffix,
+            shape_affix,        // prefix and suffix
+            shape_wildcard,
+            shape_regex
+        };
+
+        //
+        matcher( std::string const& expr, syntax s = syntax_glob );
+        virtual ~matcher();
+
+        //
+        bool matches( std::string const& path ) const;
+        bool matches( const char* path, size_t len ) const;
+
+        //
+        std::string const& expression() const { return expr_; }
+        enum syntax        grammar() const    { return syntax_; }
+        enum shape         form() const       { return shape_; }
+
+    protected:
+    private:
+        //
+        friend class matchset;
+
+        //
+        struct token
+        {
+            enum kind
+            {
+                kind_char,
+                kind_any,       // ?
+                kind_class,     // [...]
+                kind_star       // *
+            };
+
+            token( kind k, unsigned char c = 0 ) : type( k ), chr( c ) { set[ 0 ] = set[ 1 ] = set[ 2 ] = set[ 3 ] = 0; }
+
+            bool accepts( unsigned char c ) const
+            {
+                switch ( type )
+                {
+                    case kind_char:  return ( c == chr );
+                    case kind_any:   return true;
+                    case kind_class: return ( ( set[ c >> 6 ] >> ( c & 63 ) ) & 1 );
+                    default:         return false;
+                }
+            }
+
+            kind          type;
+            unsigned char chr;
+            uint64_t      set[ 4 ];
+        };
+
+        //
+        typedef std::vector<token> tokens;
+
+        //
+        matcher( matcher const& );
+        matcher& operator=( matcher const& );
+
+        //
+        void compile();
+        bool wildcard( const char* name, size_t len ) const;
+
+        //
+        std::string  expr_;
+        enum syntax  syntax_;
+        enum shape   shape_;
+        std::string  lead_;     // literal, prefix or affix head
+        std::string  tail_;     // suffix or affix tail
+        tokens       token_;
+        boost::regex regex_;
+};
+
+//
+typedef boost::shared_ptr<const matcher> matcher_ptr;
+typedef std::vector<matcher_ptr>         matchers;
+
+//
+// All the filter expressions of one directory, evaluated together in one
+// pass over the file name, so the cost follows the name and the expressions
+// that share its characters rather than the number of filters ...
+//
+//  o> literal, prefix and affix heads are merged into one trie walked from
+//     the start of the name (affix tails are then a single memcmp)
+//  o> suffix tails are merged into one trie walked back from the end
+//  o> every other glob goes into a single bit-parallel automaton, one bit
+//     per token position and all expressions side by side, stepping only
+//     the words that still hold live positions
+//  o> regular expressions cannot be merged and are run one by one
+//
+// A set holding one expression uses its matcher as is. The set is immutable
+// and shared, the caller provides the (reusable) state that carries the
+// scratch vector and the per expression result.
+//
+class matchset
+{
+    public:
+        //
+        typedef std::vector<uint64_t> bitmap;
+
+        //
+        class state
+        {
+            public:
+                state() {}
+
+                bool hit( size_t i ) const { return ( hit_[ i >> 6 ] >> ( i & 63 ) ) & 1; }
+
+            protected:
+            private:
+                friend class matchset;
+
+                bitmap cur_;
+                bitmap hit_;
+        };
+
+        //
+        matchset( matchers const& m );
+        virtual ~matchset();
+
+        //
+        bool matches( std::string const& path, state& s ) const;
+        bool matches( const char* path, size_t len, state& s ) const;
+
+        //
+        size_t          size() const                { return match_.size(); }
+        matcher const&  operator[]( size_t i ) const { return *( match_[ i ] ); }
+        matchers const& expressions() const          { return match_; }
+
+    protected:
+    private:
+        //
+        enum engine
+        {
+            engine_self,        // the matcher itself (regex, any)
+            engine_lead,        // head trie
+            engine_tail,        // tail trie
+            engine_auto         // automaton
+        };
+
+        //
+        struct node
+        {
+            typedef std::pair<unsigned char, uint32_t> edge;
+
+            std::vector<edge>     next;
+            std::vector<uint32_t> term;     // expressions whose head (tail) ends here
+
+            uint32_t find( unsigned char c ) const
+            {
+                for ( size_t i = 0; i < next.size(); ++i )
+                {
+                    if ( next[ i ].first == c )
+                        return next[ i ].second;
+                }
+
+                return 0;   // the root is never a child
+            }
+        };
+
+        //
+        typedef std::vector<node> trie;
+
+        //
+        matchset( matchset const& );
+        matchset& operator=( matchset const& );
+
+        //
+        void compile();
+        void insert( trie& t, std::string const& key, bool reverse, uint32_t expr );
+        void step( bitmap& s, size_t lo, size_t& hi, unsigned char c ) const;
+        void set( state& s, size_t i ) const { s.hit_[ i >> 6 ] |= ( (uint64_t)1 << ( i & 63 ) ); }
+
+        //
+        matchers            match_;
+        std::vector<engine> engine_;
+        trie                lead_;
+        trie                tail_;
+        std::vector<size_t> glob_;      // expression -> accepting bit
+        size_t              words_;     // automaton width
+        bitmap              init_;      // start positions (closed)
+        bitmap              self_;      // star positions, loop on any character
+        bitmap              eps_;       // star positions, entered without a character
+        bitmap              char_;      // [ 256 ][ words_ ] positions accepting the character
+};
+
+//
+typedef boost::shared_ptr<const matchset> matchset_ptr;
+
+}   // namespace mti::audit::shield::directory
+
+}}} // namespace mti::audit::shield
+
+#endif // __MATCH_HPP
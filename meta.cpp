@@ -0,0 +1,520 @@
+//
+// meta.cpp
+// ~~~~~~~~~~~~~~~~~~~~~
+//
+// Copyright (c) 2004-2012 Metasystems Technologies Inc. (MTI)
+// All rights reserved
+//
+// Distributed under the MTI Software License, Version 0.1.
+//
+// as defined by accompanying file MTI-LICENSE-0.1.info or
+// at http://www.mtihq.com/license/MTI-LICENSE-0.1.info
+//
+
+// c
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/sysmacros.h>
+#include <linux/io_uring.h>
+
+// c++
+#include <stdexcept>
+
+// boost
+#include <boost/bind.hpp>
+#include <boost/thread.hpp>
+#include <boost/atomic.hpp>
+
+// local
+#include "meta.hpp"
+
+//
+#ifndef META_DEPTH
+#define META_DEPTH  256
+#endif
+
+#ifndef META_THREADS
+#define META_THREADS  4
+#endif
+
+//
+namespace mti { namespace audit { namespace shield {
+
+//
+namespace directory {
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// class metadata_sync
+//
+////////////////////////////////////////////////////////////////////////////////
+
+class metadata_sync : public metadata
+{
+    public:
+        //
+        void fetch( int dir, requests& req, completion& c )
+        {
+            for ( requests::iterator r = req.begin(); r != req.end(); ++r )
+            {
+                (*r).status = ( ::fstatat( dir, (*r).name, &( (*r).st ), 0 ) == 0 ) ? 0 : -errno;
+                c.done( *r );
+            }
+        }
+};
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// class metadata_pool
+//
+////////////////////////////////////////////////////////////////////////////////
+
+class metadata_pool : public metadata
+{
+    public:
+        //
+        metadata_pool( size_t threads )
+            : run_( true ),
+              dir_( -1 ),
+              req_( NULL ),
+              gen_( 0 ),
+              busy_( 0 ),
+              next_( 0 ),
+              done_( 0 )
+        {
+            for ( size_t i = 0; i < threads; ++i )
+                pool_.create_thread( boost::bind( &metadata_pool::work, this ) );
+        }
+
+        //
+        ~metadata_pool()
+        {
+            {
+                boost::mutex::scoped_lock lock( mutex_ );
+                run_ = false;
+            }
+
+            wake_.notify_all();
+            pool_.join_all();
+        }
+
+        //
+        void fetch( int dir, requests& req, completion& c )
+        {
+            if ( req.empty() )
+                return;
+
+            {
+                boost::mutex::scoped_lock lock( mutex_ );
+
+                dir_  = dir;
+                req_  = &req;
+                next_ = 0;
+                done_ = 0;
+                gen_++;
+            }
+
+            wake_.notify_all();
+
+            // the caller takes its share as well
+            take( dir, req );
+
+            {
+                boost::mutex::scoped_lock lock( mutex_ );
+
+                // late workers may still hold the batch, even when it is done
+                while ( ( done_ < req.size() ) || ( busy_ > 0 ) )
+                    idle_.wait( lock );
+
+                req_ = NULL;
+            }
+
+            for ( requests::iterator r = req.begin(); r != req.end(); ++r )
+                c.done( *r );
+        }
+
+    protected:
+    private:
+        //
+        void work()
+        {
+            size_t seen = 0;
+
+            while ( true )
+            {
+                requests* req;
+                int       dir;
+
+                {
+                    boost::mutex::scoped_lock lock( mutex_ );
+
+                    while ( ( run_ ) && ( ( gen_ == seen ) || ( ! req_ ) ) )
+                        wake_.wait( lock );
+
+                    if ( ! run_ )
+                        return;
+
+                    seen = gen_;
+                    req  = req_;
+                    dir  = dir_;
+                    busy_++;
+                }
+
+                take( dir, *req );
+
+                {
+                    boost::mutex::scoped_lock lock( mutex_ );
+
+                    if ( --busy_ == 0 )
+                        idle_.notify_all();
+                }
+            }
+        }
+
+        //
+        void take( int dir, requests& req )
+        {
+            size_t i, n = 0;
+
+            while ( ( i = next_++ ) < req.size() )
+            {
+                request& r = req[ i ];
+
+                r.status = ( ::fstatat( dir, r.name, &( r.st ), 0 ) == 0 ) ? 0 : -errno;
+                n++;
+            }
+
+            if ( n > 0 )
+            {
+                boost::mutex::scoped_lock lock( mutex_ );
+
+                if ( ( done_ += n ) == req.size() )
+                    idle_.notify_all();
+            }
+        }
+
+        //
+        volatile bool             run_;
+        int                       dir_;
+        requests*                 req_;
+        size_t                    gen_;
+        size_t                    busy_;    // workers holding the batch
+        boost::atomic<size_t>     next_;
+        size_t                    done_;
+        boost::mutex              mutex_;
+        boost::condition_variable wake_;
+        boost::condition_variable idle_;
+        boost::thread_group       pool_;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// class metadata_uring
+//
+////////////////////////////////////////////////////////////////////////////////
+
+class metadata_uring : public metadata
+{
+    public:
+        //
+        metadata_uring( size_t depth )
+            : fd_( -1 ),
+              sq_( MAP_FAILED ),
+              cq_( MAP_FAILED ),
+              sqe_( MAP_FAILED ),
+              sqsz_( 0 ),
+              cqsz_( 0 ),
+              sqesz_( 0 ),
+              broken_( false )
+        {
+            struct io_uring_params p;
+
+            memset( &p, 0, sizeof( p ) );
+
+            if ( ( fd_ = ::syscall( __NR_io_uring_setup, depth, &p ) ) < 0 )
+                throw std::runtime_error( "io_uring is not available" );
+
+            sqsz_  = p.sq_off.array + p.sq_entries * sizeof( uint32_t );
+            cqsz_  = p.cq_off.cqes + p.cq_entries * sizeof( struct io_uring_cqe );
+            sqesz_ = p.sq_entries * sizeof( struct io_uring_sqe );
+
+            if ( p.features & IORING_FEAT_SINGLE_MMAP )
+                sqsz_ = cqsz_ = std::max( sqsz_, cqsz_ );
+
+            sq_ = ::mmap( NULL, sqsz_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_SQ_RING );
+
+            if ( p.features & IORING_FEAT_SINGLE_MMAP )
+                cq_ = sq_;
+            else
+                cq_ = ::mmap( NULL, cqsz_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_CQ_RING );
+
+            sqe_ = ::mmap( NULL, sqesz_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_SQES );
+
+            if ( ( sq_ == MAP_FAILED ) || ( cq_ == MAP_FAILED ) || ( sqe_ == MAP_FAILED ) )
+            {
+                release();
+                throw std::runtime_error( "io_uring rings could not be mapped" );
+            }
+
+            //
+            char* sq = static_cast<char*>( sq_ );
+            char* cq = static_cast<char*>( cq_ );
+
+            sqhead_  = reinterpret_cast<uint32_t*>( sq + p.sq_off.head );
+            sqtail_  = reinterpret_cast<uint32_t*>( sq + p.sq_off.tail );
+            sqmask_  = *reinterpret_cast<uint32_t*>( sq + p.sq_off.ring_mask );
+            sqarray_ = reinterpret_cast<uint32_t*>( sq + p.sq_off.array );
+            sqn_     = p.sq_entries;
+
+            cqhead_  = reinterpret_cast<uint32_t*>( cq + p.cq_off.head );
+            cqtail_  = reinterpret_cast<uint32_t*>( cq + p.cq_off.tail );
+            cqmask_  = *reinterpret_cast<uint32_t*>( cq + p.cq_off.ring_mask );
+            cqes_    = reinterpret_cast<struct io_uring_cqe*>( cq + p.cq_off.cqes );
+
+            sqes_    = static_cast<struct io_uring_sqe*>( sqe_ );
+        }
+
+        //
+        ~metadata_uring()
+        {
+            release();
+        }
+
+        //
+        void fetch( int dir, requests& req, completion& c )
+        {
+            size_t sent = 0, done = 0;
+
+            // the ring failed before, it is not tried again
+            if ( broken_ )
+            {
+                for ( requests::iterator r = req.begin(); r != req.end(); ++r )
+                {
+                    direct( dir, *r );
+                    c.done( *r );
+                }
+
+                return;
+            }
+
+            stx_.resize( req.size() );
+
+            while ( done < req.size() )
+            {
+                uint32_t tail   = *sqtail_;
+                uint32_t head   = __atomic_load_n( sqhead_, __ATOMIC_ACQUIRE );
+                uint32_t queued = 0;
+
+                // fill whatever room the submission ring has
+                while ( ( sent < req.size() ) && ( ( tail + queued ) - head < sqn_ ) && ( sent - done < sqn_ ) )
+                {
+                    uint32_t             idx = ( tail + queued ) & sqmask_;
+                    struct io_uring_sqe* sqe = &sqes_[ idx ];
+
+                    memset( sqe, 0, sizeof( *sqe ) );
+
+                    sqe->opcode      = IORING_OP_STATX;
+                    sqe->fd          = dir;
+                    sqe->addr        = (uint64_t)(uintptr_t)req[ sent ].name;
+                    sqe->len         = STATX_BASIC_STATS;
+                    sqe->off         = (uint64_t)(uintptr_t)&stx_[ sent ];
+                    sqe->statx_flags = AT_STATX_SYNC_AS_STAT;
+                    sqe->user_data   = sent;
+
+                    sqarray_[ idx ] = idx;
+
+                    queued++;
+                    sent++;
+                }
+
+                __atomic_store_n( sqtail_, tail + queued, __ATOMIC_RELEASE );
+
+                // everything the kernel has not consumed, an interrupted
+                // call may have left some behind
+                if ( ::syscall( __NR_io_uring_enter, fd_, ( tail + queued ) - head, 1, IORING_ENTER_GETEVENTS, NULL, 0 ) < 0 )
+                {
+                    if ( errno == EINTR )
+                        continue;
+
+                    // ENOMEM, EBUSY, a seccomp filter installed since setup, ...
+                    abandon( dir, req, sent, done, c );
+                    return;
+                }
+
+                done += reap( dir, req, c );
+            }
+        }
+
+    protected:
+    private:
+        //
+        // Hand back what has completed, in completion order. Returns how
+        // many.
+        //
+        size_t reap( int dir, requests& req, completion& c )
+        {
+            uint32_t ch = *cqhead_;
+            uint32_t ct = __atomic_load_n( cqtail_, __ATOMIC_ACQUIRE );
+            size_t   n  = 0;
+
+            for ( ; ch != ct; ++ch, ++n )
+            {
+                struct io_uring_cqe* cqe = &cqes_[ ch & cqmask_ ];
+                request&             r   = req[ cqe->user_data ];
+
+                r.status = cqe->res;
+
+                // kernels without IORING_OP_STATX
+                if ( ( r.status == -EINVAL ) || ( r.status == -EOPNOTSUPP ) )
+                    direct( dir, r );
+                else if ( r.status == 0 )
+                    convert( stx_[ cqe->user_data ], r.st );
+
+                c.done( r );
+            }
+
+            __atomic_store_n( cqhead_, ch, __ATOMIC_RELEASE );
+
+            return n;
+        }
+
+        //
+        // The ring cannot be entered any more. What the kernel has not
+        // consumed is taken back, what it has is waited for (it points into
+        // the caller's names and stx_), and the rest of the batch is stat'ed
+        // here, as is every later one.
+        //
+        void abandon( int dir, requests& req, size_t sent, size_t done, completion& c )
+        {
+            uint32_t head = __atomic_load_n( sqhead_, __ATOMIC_ACQUIRE );
+            uint32_t tail = *sqtail_;
+            size_t   busy = sent - done - ( tail - head );
+
+            broken_ = true;
+
+            for ( uint32_t i = head; i != tail; ++i )
+            {
+                request& r = req[ sqes_[ i & sqmask_ ].user_data ];
+
+                direct( dir, r );
+                c.done( r );
+            }
+
+            __atomic_store_n( sqtail_, head, __ATOMIC_RELEASE );
+
+            while ( busy > 0 )
+            {
+                size_t n = reap( dir, req, c );
+
+                if ( ( n == 0 ) && ( ::syscall( __NR_io_uring_enter, fd_, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0 ) < 0 ) )
+                    ::usleep( 1000 );
+
+                busy -= n;
+            }
+
+            for ( ; sent < req.size(); ++sent )
+            {
+                direct( dir, req[ sent ] );
+                c.done( req[ sent ] );
+            }
+        }
+
+        //
+        static void direct( int dir, request& r )
+        {
+            r.status = ( ::fstatat( dir, r.name, &( r.st ), 0 ) == 0 ) ? 0 : -errno;
+        }
+
+        //
+        static void convert( struct statx const& x, struct stat& st )
+        {
+            memset( &st, 0, sizeof( st ) );
+
+            st.st_dev          = makedev( x.stx_dev_major, x.stx_dev_minor );
+            st.st_ino          = x.stx_ino;
+            st.st_mode         = x.stx_mode;
+            st.st_nlink        = x.stx_nlink;
+            st.st_uid          = x.stx_uid;
+            st.st_gid          = x.stx_gid;
+            st.st_rdev         = makedev( x.stx_rdev_major, x.stx_rdev_minor );
+            st.st_size         = x.stx_size;
+            st.st_blksize      = x.stx_blksize;
+            st.st_blocks       = x.stx_blocks;
+            st.st_atim.tv_sec  = x.stx_atime.tv_sec;
+            st.st_atim.tv_nsec = x.stx_atime.tv_nsec;
+            st.st_mtim.tv_sec  = x.stx_mtime.tv_sec;
+            st.st_mtim.tv_nsec = x.stx_mtime.tv_nsec;
+            st.st_ctim.tv_sec  = x.stx_ctime.tv_sec;
+            st.st_ctim.tv_nsec = x.stx_ctime.tv_nsec;
+        }
+
+        //
+        void release()
+        {
+            if ( sqe_ != MAP_FAILED ) ::munmap( sqe_, sqesz_ );
+            if ( ( cq_ != MAP_FAILED ) && ( cq_ != sq_ ) ) ::munmap( cq_, cqsz_ );
+            if ( sq_ != MAP_FAILED ) ::munmap( sq_, sqsz_ );
+            if ( fd_ >= 0 ) ::close( fd_ );
+        }
+
+        //
+        int                       fd_;
+        void*                     sq_;
+        void*                     cq_;
+        void*                     sqe_;
+        size_t                    sqsz_;
+        size_t                    cqsz_;
+        size_t                    sqesz_;
+
+        uint32_t*                 sqhead_;
+        uint32_t*                 sqtail_;
+        uint32_t                  sqmask_;
+        uint32_t*                 sqarray_;
+        uint32_t                  sqn_;
+        struct io_uring_sqe*      sqes_;
+
+        uint32_t*                 cqhead_;
+        uint32_t*                 cqtail_;
+        uint32_t                  cqmask_;
+        struct io_uring_cqe*      cqes_;
+
+        std::vector<struct statx> stx_;
+        bool                      broken_;  // entering the ring failed, fstatat() from then on
+};
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// class metadata
+//
+////////////////////////////////////////////////////////////////////////////////
+
+metadata_ptr metadata::create( metadata::backend b, size_t depth /*= 0*/ )
+{
+    switch ( b )
+    {
+        case backend_uring:
+            try
+            {
+                return metadata_ptr( new metadata_uring( ( depth > 0 ) ? depth : META_DEPTH ) );
+            }
+            catch ( std::runtime_error const& )
+            {
+                // no io_uring (old kernel, seccomp, ...) use the pool instead
+            }
+
+            return metadata_ptr( new metadata_pool( META_THREADS ) );
+
+        case backend_pool:
+            return metadata_ptr( new metadata_pool( ( depth > 0 ) ? depth : META_THREADS ) );
+
+        default:
+            return metadata_ptr( new metadata_sync() );
+    }
+}
+
+}   // namespace mti::audit::shield::directory
+
+}}} // namespace mti::audit::shield
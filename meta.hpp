@@ -0,0 +1,100 @@
+//
+// meta.hpp
+// ~~~~~~~~~~~~~~~~~~~~~
+//
+// Copyright (c) 2004-2012 Metasystems Technologies Inc. (MTI)
+// All rights reserved
+//
+// Distributed under the MTI Software License, Version 0.1.
+//
+// as defined by accompanying file MTI-LICENSE-0.1.info or
+// at http://www.mtihq.com/license/MTI-LICENSE-0.1.info
+//
+
+#ifndef __META_HPP
+#define __META_HPP
+
+// c
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+// c++
+#include <vector>
+
+// boost
+#include <boost/shared_ptr.hpp>
+
+// local
+
+//
+namespace mti { namespace audit { namespace shield {
+
+//
+namespace directory {
+
+//
+// File metadata collection for the scanner. All the names accepted in one
+// batch of directory entries are handed over together, relative to the open
+// directory, and reported back through the completion as each one is done,
+// in whatever order that happens to be ...
+//
+//  o> backend_sync    one fstatat() after the other, in the calling thread
+//  o> backend_pool    fstatat() spread over a small pool of threads
+//  o> backend_uring   statx requests submitted to an io_uring in batches,
+//                     falling back to the pool when io_uring is unavailable
+//
+// An instance is used by one scanner (one thread) at a time.
+//
+class metadata
+{
+    public:
+        //
+        enum backend
+        {
+            backend_sync,
+            backend_pool,
+            backend_uring
+        };
+
+        //
+        struct request
+        {
+            request() : name( NULL ), tag( 0 ), status( 0 ) {}
+            request( const char* n, size_t t ) : name( n ), tag( t ), status( 0 ) {}
+
+            const char* name;   // relative to the directory
+            size_t      tag;    // caller's
+            struct stat st;
+            int         status; // 0 or -errno
+        };
+
+        //
+        typedef std::vector<request> requests;
+
+        //
+        class completion
+        {
+            public:
+                virtual ~completion() {}
+                virtual void done( request& r ) = 0;
+        };
+
+        //
+        virtual ~metadata() {}
+
+        //
+        virtual void fetch( int dir, requests& req, completion& c ) = 0;
+
+        // depth is the ring size or thread count, 0 for the default
+        static boost::shared_ptr<metadata> create( backend b, size_t depth = 0 );
+};
+
+//
+typedef boost::shared_ptr<metadata> metadata_ptr;
+
+}   // namespace mti::audit::shield::directory
+
+}}} // namespace mti::audit::shield
+
+#endif // __META_HPP
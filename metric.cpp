@@ -0,0 +1,499 @@
+//
+// metric.cpp
+// ~~~~~~~~~~~~~~~~~~~~~
+//
+// Copyright (c) 2004-2012 Metasystems Technologies Inc. (MTI)
+// All rights reserved
+//
+// Distributed under the MTI Software License, Version 0.1.
+//
+// as defined by accompanying file MTI-LICENSE-0.1.info or
+// at http://www.mtihq.com/license/MTI-LICENSE-0.1.info
+//
+
+// c
+#include <poll.h>
+#include <fcntl.h>
+#include <time.h>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/un.h>
+#include <sys/socket.h>
+
+// c++
+#include <sstream>
+#include <algorithm>
+#include <stdexcept>
+
+// boost
+#include <boost/bind.hpp>
+
+// local
+#include "metric.hpp"
+
+//
+#ifndef METRIC_POLL
+#define METRIC_POLL 250     // milliseconds the socket thread checks for close()
+#endif
+
+//
+namespace mti { namespace audit { namespace shield {
+
+//
+namespace directory {
+
+//
+// A label value or JSON string, quoted
+//
+static std::string quote( std::string const& s )
+{
+    std::string q( "\"" );
+
+    for ( std::string::const_iterator c = s.begin(); c != s.end(); ++c )
+    {
+        switch ( *c )
+        {
+            case '"':  q += "\\\""; break;
+            case '\\': q += "\\\\"; break;
+            case '\n': q += "\\n";  break;
+            default:
+                if ( (unsigned char)*c < 0x20 )
+                {
+                    char u[ 8 ];
+
+                    ::snprintf( u, sizeof( u ), "\\u%04x", (unsigned char)*c );
+                    q += u;
+                }
+                else
+                    q += *c;
+        }
+    }
+
+    return q + "\"";
+}
+
+//
+// The # HELP and # TYPE lines of one metric family
+//
+static void family( std::ostream& o, std::string const& name, const char* type, const char* help )
+{
+    o << "# HELP " << name << " " << help << "\n"
+      << "# TYPE " << name << " " << type << "\n";
+}
+
+//
+// A family of one line
+//
+static void one( std::ostream& o, std::string const& name, const char* type, const char* help, std::string const& label, uint64_t v )
+{
+    family( o, name, type, help );
+    o << name << label << " " << v << "\n";
+}
+
+//
+// The families with one line per query, and the sources they apply to
+//
+static struct
+{
+    const char*                   name;
+    const char*                   json;
+    const char*                   type;
+    const char*                   help;
+    uint64_t metrics::sample::*   field;
+    int                           from;
+}
+const per[] =
+{
+    { "events_total",            "events",      "counter", "Events read from the kernel",              &metrics::sample::events,      metrics::source_kernel },
+    { "matched_total",           "matched",     "counter", "Messages sent on",                         &metrics::sample::matched,     metrics::source_kernel | metrics::source_scan },
+    { "dropped_total",           "dropped",     "counter", "Events that matched nothing or were gone", &metrics::sample::dropped,     metrics::source_kernel },
+    { "stat_calls_total",        "stats",       "counter", "stat calls",                               &metrics::sample::stats,       metrics::source_kernel | metrics::source_scan },
+    { "scans_total",             "scans",       "counter", "Directory scans",                          &metrics::sample::scans,       metrics::source_scan },
+    { "scan_microseconds_total", "scan_us",     "counter", "Time spent scanning",                      &metrics::sample::scan_us,     metrics::source_scan },
+    { "scan_max_microseconds",   "scan_max_us", "gauge",   "Longest scan",                             &metrics::sample::scan_max_us, metrics::source_scan },
+    { "entries_total",           "entries",     "counter", "Directory entries visited by scans",       &metrics::sample::entries,     metrics::source_scan }
+};
+
+//
+static size_t const families = sizeof( per ) / sizeof( per[ 0 ] );
+
+//
+static bool by( std::pair<std::string, metrics::meter_ptr> const& a, std::pair<std::string, metrics::meter_ptr> const& b )
+{
+    return a.first < b.first;
+}
+
+//
+static bool full( int fd, std::string const& s )
+{
+    for ( size_t at = 0; at < s.length(); )
+    {
+        ssize_t n = ::write( fd, s.data() + at, s.length() - at );
+
+        if ( ( n < 0 ) && ( errno == EINTR ) )
+            continue;
+
+        if ( n <= 0 )
+            return false;
+
+        at += n;
+    }
+
+    return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// class metrics
+//
+////////////////////////////////////////////////////////////////////////////////
+
+metrics::metrics( std::string const& kind, metrics::source from /*= source_kernel*/ )
+    : kind_( kind ),
+      from_( from ),
+      head_( new list() ),
+      active_( 0 ),
+      run_( false ),
+      sock_( -1 )
+{
+}
+
+//
+metrics::~metrics()
+{
+    close();
+
+    delete head_.load();
+
+    for ( size_t i = 0; i < retired_.size(); ++i )
+        delete retired_[ i ];
+}
+
+//
+// A directory added again keeps its meter
+//
+metrics::meter_ptr metrics::add( std::string const& path )
+{
+    boost::mutex::scoped_lock lock( mutex_ );
+
+    list const*          o = head_.load();
+    list::const_iterator i = std::lower_bound( o->begin(), o->end(), entry( path, meter_ptr() ), by );
+
+    if ( ( i != o->end() ) && ( i->first == path ) )
+        return i->second;
+
+    meter_ptr m( new meter() );
+    list*     l = new list();
+
+    l->reserve( o->size() + 1 );
+    l->insert( l->end(), o->begin(), i );
+    l->push_back( entry( path, m ) );
+    l->insert( l->end(), i, o->end() );
+
+    publish( l );
+
+    return m;
+}
+
+//
+void metrics::del( std::string const& path )
+{
+    boost::mutex::scoped_lock lock( mutex_ );
+
+    list const* o = head_.load();
+    list*       l = new list();
+
+    l->reserve( o->size() );
+
+    for ( list::const_iterator i = o->begin(); i != o->end(); ++i )
+    {
+        if ( i->first != path )
+            l->push_back( *i );
+    }
+
+    publish( l );
+}
+
+//
+// Swap the list in, and free the old ones once no snapshot can still be
+// reading them. Called with mutex_ held.
+//
+void metrics::publish( list* l )
+{
+    retired_.push_back( head_.exchange( l ) );
+
+    if ( active_.load() > 0 )
+        return;
+
+    for ( size_t i = 0; i < retired_.size(); ++i )
+        delete retired_[ i ];
+
+    retired_.clear();
+}
+
+//
+metrics::snapshot metrics::snap() const
+{
+    snapshot s;
+
+    s.kind        = kind_;
+    s.from        = from_;
+    s.reads       = all.reads.load();
+    s.read_bytes  = all.read_bytes.load();
+    s.read_max    = all.read_max.load();
+    s.overflows   = all.overflows.load();
+    s.emits       = all.emits.load();
+    s.emit_us     = all.emit_us.load();
+    s.emit_max_us = all.emit_max_us.load();
+
+    if ( queue )
+        s.queue = queue();
+
+    reader      r( active_ );
+    list const* l = head_.load();
+
+    s.query.reserve( l->size() );
+
+    for ( list::const_iterator i = l->begin(); i != l->end(); ++i )
+    {
+        meter const& m = *i->second;
+        sample       q;
+
+        q.path        = i->first;
+        q.events      = m.events.load();
+        q.matched     = m.matched.load();
+        q.dropped     = m.dropped.load();
+        q.stats       = m.stats.load();
+        q.scans       = m.scans.load();
+        q.scan_us     = m.scan_us.load();
+        q.scan_max_us = m.scan_max_us.load();
+        q.entries     = m.entries.load();
+
+        s.query.push_back( q );
+    }
+
+    return s;
+}
+
+//
+// Prometheus text exposition (counters end in _total), each family typed
+// and its lines together, or one JSON object. Families the source of the
+// instance never counts are left out rather than shown as zeros.
+//
+std::string metrics::text( metrics::format f /*= format_prometheus*/ ) const
+{
+    snapshot           s = snap();
+    std::ostringstream o;
+
+    if ( f == format_json )
+    {
+        o << "{\"kind\":" << quote( s.kind );
+
+        if ( s.from == source_kernel )
+        {
+            o << ",\"reads\":" << s.reads
+              << ",\"read_bytes\":" << s.read_bytes
+              << ",\"read_max\":" << s.read_max
+              << ",\"overflows\":" << s.overflows;
+        }
+
+        o << ",\"emits\":" << s.emits
+          << ",\"emit_us\":" << s.emit_us
+          << ",\"emit_max_us\":" << s.emit_max_us
+          << ",\"queue\":{\"depth\":" << s.queue.depth
+          << ",\"peak\":" << s.queue.peak
+          << ",\"pushed\":" << s.queue.pushed
+          << ",\"sent\":" << s.queue.sent
+          << ",\"dropped\":" << s.queue.dropped
+          << ",\"coalesced\":" << s.queue.coalesced
+          << ",\"blocked\":" << s.queue.blocked
+          << "},\"query\":[";
+
+        for ( size_t i = 0; i < s.query.size(); ++i )
+        {
+            sample const& q = s.query[ i ];
+
+            o << ( ( i > 0 ) ? "," : "" ) << "{\"path\":" << quote( q.path );
+
+            for ( size_t f = 0; f < families; ++f )
+            {
+                if ( per[ f ].from & s.from )
+                    o << ",\"" << per[ f ].json << "\":" << q.*per[ f ].field;
+            }
+
+            o << "}";
+        }
+
+        o << "]}\n";
+        return o.str();
+    }
+
+    std::string p = "directory_" + s.kind + "_";
+    std::string k = "{kind=" + quote( s.kind ) + "}";
+
+    if ( s.from == source_kernel )
+    {
+        one( o, p + "reads_total", "counter", "Kernel reads", k, s.reads );
+        one( o, p + "read_bytes_total", "counter", "Bytes the kernel reads returned", k, s.read_bytes );
+        one( o, p + "read_max_bytes", "gauge", "Largest kernel read", k, s.read_max );
+        one( o, p + "overflows_total", "counter", "Kernel queue overflows", k, s.overflows );
+    }
+
+    one( o, p + "emits_total", "counter", "Batches handed to the slots", k, s.emits );
+    one( o, p + "emit_microseconds_total", "counter", "Time spent in the slots", k, s.emit_us );
+    one( o, p + "emit_max_microseconds", "gauge", "Longest time in the slots", k, s.emit_max_us );
+    one( o, p + "queue_depth", "gauge", "Batches queued to the slots", k, s.queue.depth );
+    one( o, p + "queue_peak", "gauge", "Most batches ever queued", k, s.queue.peak );
+    one( o, p + "queue_pushed_total", "counter", "Batches handed to the queue", k, s.queue.pushed );
+    one( o, p + "queue_sent_total", "counter", "Batches taken off the queue", k, s.queue.sent );
+    one( o, p + "queue_dropped_total", "counter", "Oldest batches dropped from a full queue", k, s.queue.dropped );
+    one( o, p + "queue_coalesced_total", "counter", "Batches merged into the held one", k, s.queue.coalesced );
+    one( o, p + "queue_blocked_total", "counter", "Pushes that waited for room", k, s.queue.blocked );
+
+    // the lines of a family are kept together, one per query
+    for ( size_t f = 0; f < families; ++f )
+    {
+        if ( ! ( per[ f ].from & s.from ) )
+            continue;
+
+        family( o, p + per[ f ].name, per[ f ].type, per[ f ].help );
+
+        for ( size_t i = 0; i < s.query.size(); ++i )
+            o << p << per[ f ].name << "{path=" << quote( s.query[ i ].path ) << "} " << s.query[ i ].*per[ f ].field << "\n";
+    }
+
+    return o.str();
+}
+
+//
+bool metrics::dump( std::string const& path, metrics::format f /*= format_prometheus*/ ) const
+{
+    std::string tmp = path + ".tmp";
+    int         fd  = ::open( tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644 );
+
+    if ( fd < 0 )
+        return false;
+
+    bool ok = full( fd, text( f ) );
+
+    ok = ( ::close( fd ) == 0 ) && ( ok );
+
+    if ( ( ok ) && ( ::rename( tmp.c_str(), path.c_str() ) == 0 ) )
+        return true;
+
+    ::unlink( tmp.c_str() );
+    return false;
+}
+
+//
+void metrics::serve( std::string const& socket, metrics::format f /*= format_prometheus*/ )
+{
+    struct sockaddr_un addr;
+
+    close();
+
+    if ( socket.length() >= sizeof( addr.sun_path ) )
+        throw std::invalid_argument( "metrics::serve: " + socket + " is too long for a socket path" );
+
+    ::memset( &addr, 0, sizeof( addr ) );
+    addr.sun_family = AF_UNIX;
+    ::strncpy( addr.sun_path, socket.c_str(), sizeof( addr.sun_path ) - 1 );
+
+    if ( ( sock_ = ::socket( AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0 ) ) < 0 )
+        throw std::runtime_error( "Could not create the metrics socket" );
+
+    // a socket left behind by an earlier run
+    ::unlink( socket.c_str() );
+
+    if ( ( ::bind( sock_, (struct sockaddr*)&addr, sizeof( addr ) ) < 0 ) || ( ::listen( sock_, 8 ) < 0 ) )
+    {
+        ::close( sock_ );
+        sock_ = -1;
+
+        throw std::runtime_error( "Could not listen on " + socket + ": " + ::strerror( errno ) );
+    }
+
+    path_ = socket;
+    run_  = true;
+
+    pool_.create_thread( boost::bind( &metrics::listen, this, sock_, f ) );
+}
+
+//
+void metrics::close()
+{
+    if ( sock_ < 0 )
+        return;
+
+    run_ = false;
+    pool_.join_all();
+
+    ::close( sock_ );
+    ::unlink( path_.c_str() );
+
+    sock_ = -1;
+    path_.clear();
+}
+
+//
+void metrics::listen( int fd, metrics::format f )
+{
+    struct pollfd p;
+
+    p.fd     = fd;
+    p.events = POLLIN;
+
+    while ( run_ )
+    {
+        if ( ::poll( &p, 1, METRIC_POLL ) <= 0 )
+            continue;
+
+        int c = ::accept4( fd, NULL, NULL, SOCK_CLOEXEC );
+
+        if ( c < 0 )
+            continue;
+
+        full( c, text( f ) );
+        ::close( c );
+    }
+}
+
+//
+void metrics::emitted( uint64_t us )
+{
+    count( all.emits );
+    count( all.emit_us, us );
+    most( all.emit_max_us, us );
+}
+
+//
+void metrics::read( uint64_t bytes )
+{
+    count( all.reads );
+    count( all.read_bytes, bytes );
+    most( all.read_max, bytes );
+}
+
+//
+void metrics::most( metrics::counter& c, uint64_t v )
+{
+    uint64_t o = c.load( boost::memory_order_relaxed );
+
+    while ( ( v > o ) && ( ! c.compare_exchange_weak( o, v, boost::memory_order_relaxed ) ) )
+        ;
+}
+
+//
+uint64_t metrics::clock()
+{
+    struct timespec ts;
+
+    ::clock_gettime( CLOCK_MONOTONIC, &ts );
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+}   // namespace mti::audit::shield::directory
+
+}}} // namespace mti::audit::shield
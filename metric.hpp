@@ -0,0 +1,217 @@
+//
+// metric.hpp
+// ~~~~~~~~~~~~~~~~~~~~~
+//
+// Copyright (c) 2004-2012 Metasystems Technologies Inc. (MTI)
+// All rights reserved
+//
+// Distributed under the MTI Software License, Version 0.1.
+//
+// as defined by accompanying file MTI-LICENSE-0.1.info or
+// at http://www.mtihq.com/license/MTI-LICENSE-0.1.info
+//
+
+#ifndef __METRIC_HPP
+#define __METRIC_HPP
+
+// c
+#include <stdint.h>
+
+// c++
+#include <string>
+#include <vector>
+
+// boost
+#include <boost/atomic.hpp>
+#include <boost/thread.hpp>
+#include <boost/function.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/noncopyable.hpp>
+
+// local
+#include "dispatch.hpp"
+
+//
+namespace mti { namespace audit { namespace shield {
+
+//
+namespace directory {
+
+//
+// Counters a monitor, polling or volume keeps about itself: one meter per
+// query, held by the query so the thread reading events or scanning counts
+// without a lookup, and one set for the whole instance. Every counter is an
+// atomic bumped relaxed. The meters are a copy-on-write list, as the slots
+// of a fanout are: add() and del() publish a new list, a snapshot loads the
+// current one and takes no lock at all. Only what applies to the source of
+// the instance (kernel events, or scans) is rendered, as Prometheus text or
+// JSON, written to a file, or served on a unix socket to whatever scrapes
+// it.
+//
+class metrics : private boost::noncopyable
+{
+    public:
+        //
+        typedef boost::atomic<uint64_t> counter;
+
+        //
+        // where the instance's messages come from
+        //
+        enum source
+        {
+            source_kernel = 1,      // events read (monitor, volume)
+            source_scan   = 2       // directory scans (polling)
+        };
+
+        //
+        // per query
+        //
+        struct meter
+        {
+            meter() : events( 0 ), matched( 0 ), dropped( 0 ), stats( 0 ), scans( 0 ), scan_us( 0 ), scan_max_us( 0 ), entries( 0 ) {}
+
+            counter events;         // read from the kernel
+            counter matched;        // sent on: matched a filter, or changed
+            counter dropped;        // read but matched nothing, or gone before stat
+            counter stats;          // stat calls
+            counter scans;          // directory scans
+            counter scan_us;        // time scanning, microseconds
+            counter scan_max_us;    // longest scan
+            counter entries;        // directory entries visited by scans
+        };
+
+        //
+        typedef boost::shared_ptr<meter> meter_ptr;
+
+        //
+        // for the whole instance
+        //
+        struct gauge
+        {
+            gauge() : reads( 0 ), read_bytes( 0 ), read_max( 0 ), overflows( 0 ), emits( 0 ), emit_us( 0 ), emit_max_us( 0 ) {}
+
+            counter reads;          // kernel reads (inotify, fanotify)
+            counter read_bytes;     // bytes they returned
+            counter read_max;       // largest read
+            counter overflows;      // kernel queue overflows
+            counter emits;          // batches handed to the slots
+            counter emit_us;        // time in the slots, microseconds
+            counter emit_max_us;    // longest
+        };
+
+        //
+        // a copy of every counter at one time
+        //
+        struct sample
+        {
+            sample() : events( 0 ), matched( 0 ), dropped( 0 ), stats( 0 ), scans( 0 ), scan_us( 0 ), scan_max_us( 0 ), entries( 0 ) {}
+
+            std::string path;
+            uint64_t    events;
+            uint64_t    matched;
+            uint64_t    dropped;
+            uint64_t    stats;
+            uint64_t    scans;
+            uint64_t    scan_us;
+            uint64_t    scan_max_us;
+            uint64_t    entries;
+        };
+
+        //
+        struct snapshot
+        {
+            snapshot() : from( source_kernel ), reads( 0 ), read_bytes( 0 ), read_max( 0 ), overflows( 0 ), emits( 0 ), emit_us( 0 ), emit_max_us( 0 ) {}
+
+            std::string         kind;
+            enum source         from;
+            uint64_t            reads;
+            uint64_t            read_bytes;
+            uint64_t            read_max;
+            uint64_t            overflows;
+            uint64_t            emits;
+            uint64_t            emit_us;
+            uint64_t            emit_max_us;
+            dispatch::counters  queue;
+            std::vector<sample> query;
+        };
+
+        //
+        enum format
+        {
+            format_prometheus,
+            format_json
+        };
+
+        //
+        metrics( std::string const& kind, source from = source_kernel );
+        virtual ~metrics();
+
+        //
+        meter_ptr add( std::string const& path );
+        void del( std::string const& path );
+
+        //
+        snapshot snap() const;
+        std::string text( format f = format_prometheus ) const;
+
+        // written whole, through a temporary file renamed over path
+        bool dump( std::string const& path, format f = format_prometheus ) const;
+
+        // each connection to the socket is sent one snapshot and closed
+        void serve( std::string const& socket, format f = format_prometheus );
+        void close();
+
+        //
+        void emitted( uint64_t us );
+        void read( uint64_t bytes );
+
+        //
+        static void count( counter& c, uint64_t n = 1 ) { c.fetch_add( n, boost::memory_order_relaxed ); }
+        static void most( counter& c, uint64_t v );
+        static uint64_t clock();   // monotonic microseconds
+
+        //
+        gauge                                     all;
+        boost::function<dispatch::counters ()>    queue;  // the owner's dispatch queue
+
+    protected:
+    private:
+        //
+        typedef std::pair<std::string, meter_ptr> entry;
+        typedef std::vector<entry>                list;     // by path
+
+        //
+        // counts a snapshot in and out of the list it loaded
+        //
+        struct reader
+        {
+            reader( boost::atomic<size_t>& a ) : a_( a ) { ++a_; }
+            ~reader() { --a_; }
+
+            boost::atomic<size_t>& a_;
+        };
+
+        //
+        void publish( list* l );
+        void listen( int fd, format f );
+
+        //
+        std::string         kind_;
+        source              from_;
+        boost::mutex        mutex_;     // writers of head_, never taken counting
+        boost::atomic<list*>
+                            head_;      // path -> meter
+        mutable boost::atomic<size_t>
+                            active_;    // snapshots under way
+        std::vector<list*>  retired_;   // replaced, maybe still read
+        volatile bool       run_;
+        int                 sock_;
+        std::string         path_;      // of the socket
+        boost::thread_group pool_;
+};
+
+}   // namespace mti::audit::shield::directory
+
+}}} // namespace mti::audit::shield
+
+#endif // __METRIC_HPP
@@ -0,0 +1,401 @@
+//
+// scan.cpp
+// ~~~~~~~~~~~~~~~~~~~~~
+//
+// Copyright (c) 2004-2012 Metasystems Technologies Inc. (MTI)
+// All rights reserved
+//
+// Distributed under the MTI Software License, Version 0.1.
+//
+// as defined by accompanying file MTI-LICENSE-0.1.info or
+// at http://www.mtihq.com/license/MTI-LICENSE-0.1.info
+//
+
+// c
+#include <fcntl.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+// c++
+
+// boost
+#include <boost/bind.hpp>
+#include <boost/thread.hpp>
+
+// local
+#include "scan.hpp"
+
+//
+#ifndef SCAN_BUFFER
+#define SCAN_BUFFER ( 256 * 1024 )
+#endif
+
+//
+namespace mti { namespace audit { namespace shield {
+
+//
+namespace directory {
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// class scanner
+//
+////////////////////////////////////////////////////////////////////////////////
+
+scanner::scanner( size_t buffer /*= 0*/, metadata_ptr meta /*= metadata_ptr()*/ )
+    : buff_( ( buffer > 0 ) ? buffer : SCAN_BUFFER ),
+      meta_( meta )
+{
+    if ( ! meta_ )
+        meta_ = metadata::create( metadata::backend_sync );
+}
+
+//
+scanner::~scanner()
+{
+}
+
+//
+// Hands the files collected by the metadata backend to the visitor
+//
+class scanner::deliver : public metadata::completion
+{
+    public:
+        deliver( scanner& s, scanner::visitor& v, size_t prefix, size_t depth ) : scan_( s ), visit_( v ), prefix_( prefix ), depth_( depth ) {}
+
+        //
+        void done( metadata::request& r )
+        {
+            // a link is only taken when it leads to a regular file
+            if ( ( r.status != 0 ) || ( ! S_ISREG( r.st.st_mode ) ) )
+                return;
+
+            scan_.path_.resize( prefix_ );
+            scan_.path_ += r.name;
+
+            visit_.found( scan_.path_, r.st, depth_, r.tag );
+        }
+
+    protected:
+    private:
+        scanner&          scan_;
+        scanner::visitor& visit_;
+        size_t            prefix_;
+        size_t            depth_;
+};
+
+//
+size_t scanner::scan( std::string const& dir, bool recur, scanner::visitor& v )
+{
+    std::vector<pending> todo;
+    size_t               seen = 0;
+
+    todo.push_back( pending( dir, 0 ) );
+
+    while ( todo.size() > 0 )
+    {
+        pending next( todo.back() );
+
+        todo.pop_back();
+        seen += read( next, recur, v, todo );
+
+        //
+        boost::this_thread::interruption_point();
+    }
+
+    return seen;
+}
+
+//
+size_t scanner::read( scanner::pending const& dir, bool recur, scanner::visitor& v, std::vector<scanner::pending>& todo )
+{
+    size_t seen = 0;
+    int    fd;
+
+    //
+    if ( ( fd = ::open( dir.path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC ) ) < 0 )
+        return seen;
+
+    path_ = dir.path;
+    path_ += '/';
+
+    size_t prefix = path_.length();
+    long   len;
+
+    while ( ( len = ::syscall( SYS_getdents64, fd, &buff_[ 0 ], buff_.size() ) ) > 0 )
+    {
+        for ( long i = 0; i < len; )
+        {
+            struct dirent64* d    = reinterpret_cast<struct dirent64*>( &buff_[ i ] );
+            const char*      name = d->d_name;
+            unsigned char    type = d->d_type;
+            struct stat      st;
+            bool             known = false;
+
+            i += d->d_reclen;
+
+            if ( ( name[ 0 ] == '.' ) && ( ( name[ 1 ] == 0 ) || ( ( name[ 1 ] == '.' ) && ( name[ 2 ] == 0 ) ) ) )
+                continue;
+
+            seen++;
+
+            // the file system did not say, ask without following links
+            if ( type == DT_UNKNOWN )
+            {
+                if ( ::fstatat( fd, name, &st, AT_SYMLINK_NOFOLLOW ) < 0 )
+                    continue;
+
+                if ( S_ISDIR( st.st_mode ) )
+                    type = DT_DIR;
+                else if ( S_ISREG( st.st_mode ) )
+                {
+                    type  = DT_REG;
+                    known = true;
+                }
+                else if ( S_ISLNK( st.st_mode ) )
+                    type = DT_LNK;
+            }
+
+            //
+            path_.resize( prefix );
+            path_ += name;
+
+            if ( type == DT_DIR )
+            {
+                if ( ( recur ) && ( v.enter( path_, dir.depth + 1 ) ) )
+                    todo.push_back( pending( path_, dir.depth + 1 ) );
+
+                continue;
+            }
+
+            if ( ( type != DT_REG ) && ( type != DT_LNK ) )
+                continue;
+
+            size_t tag = 0;
+
+            if ( ! v.accept( path_, dir.depth, tag ) )
+                continue;
+
+            if ( known )
+                v.found( path_, st, dir.depth, tag );
+            else
+                req_.push_back( metadata::request( name, tag ) );
+        }
+
+        // the names live in buff_, collect before the next batch of entries
+        if ( req_.size() > 0 )
+        {
+            deliver done( *this, v, prefix, dir.depth );
+
+            meta_->fetch( fd, req_, done );
+            req_.clear();
+        }
+    }
+
+    ::close( fd );
+
+    return seen;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// class walker
+//
+////////////////////////////////////////////////////////////////////////////////
+
+walker::walker( size_t threads /*= 0*/, metadata::backend b /*= metadata::backend_sync*/ )
+    : run_( true ),
+      queued_( 0 ),
+      next_( 0 )
+{
+    if ( threads == 0 )
+        threads = boost::thread::hardware_concurrency();
+
+    if ( threads == 0 )
+        threads = 1;
+
+    for ( size_t i = 0; i < threads; ++i )
+    {
+        queue_.push_back( queue_ptr( new queue() ) );
+        scan_.push_back( scanner_ptr( new scanner( 0, metadata::create( b ) ) ) );
+    }
+
+    for ( size_t i = 0; i < threads; ++i )
+        pool_.create_thread( boost::bind( &walker::work, this, i ) );
+}
+
+//
+walker::~walker()
+{
+    {
+        boost::mutex::scoped_lock lock( mutex_ );
+        run_ = false;
+    }
+
+    cond_.notify_all();
+    pool_.join_all();
+}
+
+//
+size_t walker::walk( std::string const& dir, scanner::visitor& v )
+{
+    job j( v, queue_.size() );
+
+    // every worker needs a copy, check the visitor can give one
+    scanner::visitor* probe = v.clone();
+
+    if ( ! probe )
+    {
+        scanner s;
+        return s.scan( dir, true, v );
+    }
+
+    j.local[ 0 ] = probe;
+    j.pending    = 1;
+
+    push( next_++ % queue_.size(), task( &j, scanner::pending( dir, 0 ) ) );
+
+    //
+    {
+        boost::mutex::scoped_lock lock( j.mutex );
+
+        try
+        {
+            while ( j.pending > 0 )
+                j.done.wait( lock );
+        }
+        catch ( boost::thread_interrupted const& )
+        {
+            boost::this_thread::disable_interruption hold;
+
+            // the job lives on this stack, let the workers drop its tasks
+            j.cancel = true;
+
+            while ( j.pending > 0 )
+                j.done.wait( lock );
+
+            for ( size_t i = 0; i < j.local.size(); ++i )
+                delete j.local[ i ];
+
+            throw;
+        }
+    }
+
+    //
+    for ( size_t i = 0; i < j.local.size(); ++i )
+    {
+        if ( j.local[ i ] )
+        {
+            v.merge( *( j.local[ i ] ) );
+            delete j.local[ i ];
+        }
+    }
+
+    return j.seen;
+}
+
+//
+void walker::work( size_t id )
+{
+    std::vector<scanner::pending> todo;
+
+    while ( run_ )
+    {
+        task t;
+
+        if ( ! take( id, t ) )
+        {
+            boost::mutex::scoped_lock lock( mutex_ );
+
+            if ( ( run_ ) && ( queued_ == 0 ) )
+                cond_.timed_wait( lock, boost::posix_time::milliseconds( 10 ) );
+
+            continue;
+        }
+
+        //
+        job* j = t.owner;
+
+        if ( ! j->cancel )
+        {
+            if ( ! j->local[ id ] )
+                j->local[ id ] = j->root.clone();
+
+            todo.clear();
+            j->seen += scan_[ id ]->read( t.dir, true, *( j->local[ id ] ), todo );
+
+            // account for the children before this task completes
+            j->pending += todo.size();
+
+            for ( size_t i = 0; i < todo.size(); ++i )
+                push( id, task( j, todo[ i ] ) );
+        }
+
+        finish( j );
+    }
+}
+
+//
+bool walker::take( size_t id, walker::task& t )
+{
+    // own work first, newest
+    {
+        boost::mutex::scoped_lock lock( queue_[ id ]->mutex );
+
+        if ( queue_[ id ]->tasks.size() > 0 )
+        {
+            t = queue_[ id ]->tasks.back();
+            queue_[ id ]->tasks.pop_back();
+            queued_--;
+
+            return true;
+        }
+    }
+
+    // then steal, oldest
+    for ( size_t n = 1; n < queue_.size(); ++n )
+    {
+        queue_ptr q = queue_[ ( id + n ) % queue_.size() ];
+
+        boost::mutex::scoped_lock lock( q->mutex );
+
+        if ( q->tasks.size() > 0 )
+        {
+            t = q->tasks.front();
+            q->tasks.pop_front();
+            queued_--;
+
+            return true;
+        }
+    }
+
+    return false;
+}
+
+//
+void walker::push( size_t id, walker::task const& t )
+{
+    {
+        boost::mutex::scoped_lock lock( queue_[ id ]->mutex );
+
+        queue_[ id ]->tasks.push_back( t );
+        queued_++;
+    }
+
+    cond_.notify_one();
+}
+
+//
+void walker::finish( walker::job* j )
+{
+    // under the job lock, the caller may drop the job as soon as it is done
+    boost::mutex::scoped_lock lock( j->mutex );
+
+    if ( --( j->pending ) == 0 )
+        j->done.notify_all();
+}
+
+}   // namespace mti::audit::shield::directory
+
+}}} // namespace mti::audit::shield
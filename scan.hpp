@@ -0,0 +1,194 @@
+//
+// scan.hpp
+// ~~~~~~~~~~~~~~~~~~~~~
+//
+// Copyright (c) 2004-2012 Metasystems Technologies Inc. (MTI)
+// All rights reserved
+//
+// Distributed under the MTI Software License, Version 0.1.
+//
+// as defined by accompanying file MTI-LICENSE-0.1.info or
+// at http://www.mtihq.com/license/MTI-LICENSE-0.1.info
+//
+
+#ifndef __SCAN_HPP
+#define __SCAN_HPP
+
+// c
+#include <sys/stat.h>
+#include <sys/types.h>
+
+// c++
+#include <deque>
+#include <string>
+#include <vector>
+
+// boost
+#include <boost/thread.hpp>
+#include <boost/atomic.hpp>
+#include <boost/shared_ptr.hpp>
+
+// local
+#include "meta.hpp"
+
+//
+namespace mti { namespace audit { namespace shield {
+
+//
+namespace directory {
+
+//
+// Low level directory scanner, reading entries in large getdents64 batches
+// from an open directory descriptor. The entry type (d_type) decides what is
+// a file and what is descended into, so the only other syscall per entry is
+// the metadata lookup relative to the directory, and only for names the
+// visitor accepted. Those lookups are handed to the metadata backend a batch
+// of entries at a time. Entries of unknown type (some file systems) are
+// resolved with fstatat() first, links are followed for files but never
+// descended into.
+//
+class scanner
+{
+    public:
+        //
+        class visitor
+        {
+            public:
+                virtual ~visitor() {}
+
+                // the name test, path is only valid for the duration of the call,
+                // tag is handed back with the file
+                virtual bool accept( std::string const& path, size_t depth, size_t& tag ) = 0;
+
+                // a regular file that was accepted, not necessarily in order
+                virtual void found( std::string const& path, struct stat const& st, size_t depth, size_t tag ) = 0;
+
+                // a subdirectory of a recursive scan, false leaves it out
+                virtual bool enter( std::string const& /* path */, size_t /* depth */ ) { return true; }
+
+                // parallel walks give every worker its own copy, merged at the end
+                virtual visitor* clone() const { return NULL; }
+                virtual void     merge( visitor& /* v */ ) {}
+        };
+
+        //
+        struct pending
+        {
+            pending() : depth( 0 ) {}
+            pending( std::string const& p, size_t d ) : path( p ), depth( d ) {}
+
+            std::string path;
+            size_t      depth;
+        };
+
+        //
+        scanner( size_t buffer = 0, metadata_ptr meta = metadata_ptr() );
+        virtual ~scanner();
+
+        // returns the number of directory entries visited
+        size_t scan( std::string const& dir, bool recur, visitor& v );
+
+        // one directory, subdirectories are appended to todo when recur
+        size_t read( pending const& dir, bool recur, visitor& v, std::vector<pending>& todo );
+
+    protected:
+    private:
+        //
+        class deliver;
+
+        //
+        scanner( scanner const& );
+        scanner& operator=( scanner const& );
+
+        //
+        std::vector<char>  buff_;
+        std::string        path_;
+        metadata_ptr       meta_;
+        metadata::requests req_;
+};
+
+//
+// Parallel recursive scan. Every subdirectory becomes a task on a pool of
+// workers, each with its own deque: a worker takes the newest task from the
+// back of its own (depth first, the directory is still warm) and, when that
+// runs dry, steals the oldest task from the front of another, which tends to
+// be the biggest piece of the tree left.
+//
+// Each worker feeds its own clone of the visitor, merged into the caller's
+// once the walk is done. Visitors that cannot be cloned are scanned in the
+// calling thread.
+//
+class walker
+{
+    public:
+        //
+        walker( size_t threads = 0,     // 0 = one per core
+                metadata::backend b = metadata::backend_sync );
+        virtual ~walker();
+
+        // returns the number of directory entries visited
+        size_t walk( std::string const& dir, scanner::visitor& v );
+
+    protected:
+    private:
+        //
+        walker( walker const& );
+        walker& operator=( walker const& );
+
+        //
+        struct job
+        {
+            job( scanner::visitor& v, size_t n ) : root( v ), local( n, NULL ), pending( 0 ), seen( 0 ), cancel( false ) {}
+
+            scanner::visitor&              root;
+            std::vector<scanner::visitor*> local;   // per worker clones
+            boost::atomic<size_t>          pending; // tasks queued or running
+            boost::atomic<size_t>          seen;
+            volatile bool                  cancel;
+            boost::mutex                   mutex;
+            boost::condition_variable      done;
+        };
+
+        //
+        struct task
+        {
+            task() : owner( NULL ) {}
+            task( job* j, scanner::pending const& d ) : owner( j ), dir( d ) {}
+
+            job*             owner;
+            scanner::pending dir;
+        };
+
+        //
+        struct queue
+        {
+            boost::mutex     mutex;
+            std::deque<task> tasks;
+        };
+
+        //
+        typedef boost::shared_ptr<queue>   queue_ptr;
+        typedef boost::shared_ptr<scanner> scanner_ptr;
+
+        //
+        void work( size_t id );
+        bool take( size_t id, task& t );
+        void push( size_t id, task const& t );
+        void finish( job* j );
+
+        //
+        volatile bool             run_;
+        std::vector<queue_ptr>    queue_;
+        std::vector<scanner_ptr>  scan_;
+        boost::atomic<size_t>     queued_;
+        boost::atomic<size_t>     next_;
+        boost::mutex              mutex_;
+        boost::condition_variable cond_;
+        boost::thread_group       pool_;
+};
+
+}   // namespace mti::audit::shield::directory
+
+}}} // namespace mti::audit::shield
+
+#endif // __SCAN_HPP
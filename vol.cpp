@@ -0,0 +1,747 @@
+//
+// vol.cpp
+// ~~~~~~~~~~~~~~~~~~~~~
+//
+// Copyright (c) 2004-2012 Metasystems Technologies Inc. (MTI)
+// All rights reserved
+//
+// Distributed under the MTI Software License, Version 0.1.
+//
+// as defined by accompanying file MTI-LICENSE-0.1.info or
+// at http://www.mtihq.com/license/MTI-LICENSE-0.1.info
+//
+
+// c
+#include <stdio.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <string.h>
+#include <sys/vfs.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/fanotify.h>
+
+// c++
+#include <vector>
+#include <algorithm>
+#include <stdexcept>
+
+// boost
+#include <boost/bind.hpp>
+#include <boost/filesystem.hpp>
+
+// local
+#include "vol.hpp"
+
+//
+#ifndef INVALID_HANDLE
+#define INVALID_HANDLE  -1
+#endif
+
+// room for the largest single event: metadata, a directory handle and a name
+#ifndef VOLUME_EVENT
+#define VOLUME_EVENT    4096
+#endif
+
+#ifndef VOLUME_BUFFER
+#define VOLUME_BUFFER   ( VOLUME_EVENT * 16 )
+#endif
+
+// a mount mark takes no directory entry events
+#define VOLUME_MOUNT    ( FAN_ACCESS | FAN_MODIFY | FAN_CLOSE_WRITE | FAN_CLOSE_NOWRITE | FAN_OPEN )
+
+// what is asked of a filesystem mark beyond the filters, renames of
+// directories (the cache) and events on directories themselves; headers
+// with FAN_RENAME say nothing of the running kernel (5.17 or later), a
+// mark it refuses is tried again with FAN_MOVE
+#ifdef  FAN_RENAME
+#define VOLUME_MOVE     FAN_RENAME
+#else
+#define VOLUME_MOVE     FAN_MOVE
+#endif
+
+#ifndef VOLUME_EPOLL
+#define VOLUME_EPOLL    2
+#endif
+
+//
+namespace mti { namespace audit { namespace shield {
+
+//
+namespace directory {
+
+//
+// Is path the directory or below it
+//
+static bool within( std::string const& path, std::string const& dir )
+{
+    return ( path.compare( 0, dir.length(), dir ) == 0 ) &&
+           ( ( path.length() == dir.length() ) || ( path[ dir.length() ] == '/' ) || ( dir == "/" ) );
+}
+
+//
+static std::string fsid( std::string const& path )
+{
+    struct statfs st;
+
+    if ( ::statfs( path.c_str(), &st ) < 0 )
+        throw std::runtime_error( "volume: could not identify the filesystem of " + path );
+
+    return std::string( (const char*)&st.f_fsid, sizeof( st.f_fsid ) );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// class volume
+//
+////////////////////////////////////////////////////////////////////////////////
+
+volume::volume( volume::options opt /*= volume::options()*/ )
+    : run_( false ),
+      opt_( opt ),
+      fd_( INVALID_HANDLE ),
+      ep_( INVALID_HANDLE ),
+      ev_( INVALID_HANDLE ),
+      size_( 0 ),
+      move_( VOLUME_MOVE ),
+      send_( opt_.queue,
+             boost::bind( &volume::deliver, this, _1 ),
+             boost::bind( &absorbed<messages>, _1, _2 ),
+             boost::bind( &sealed<messages>, _1, opt_.order ) ),
+      meter_( "volume" )
+{
+    meter_.queue = boost::bind( &volume::queued, this );
+}
+
+//
+volume::volume( const volume::slot_t& handler, volume::options opt /*= volume::options()*/ )
+    : run_( false ),
+      opt_( opt ),
+      fd_( INVALID_HANDLE ),
+      ep_( INVALID_HANDLE ),
+      ev_( INVALID_HANDLE ),
+      size_( 0 ),
+      move_( VOLUME_MOVE ),
+      send_( opt_.queue,
+             boost::bind( &volume::deliver, this, _1 ),
+             boost::bind( &absorbed<messages>, _1, _2 ),
+             boost::bind( &sealed<messages>, _1, opt_.order ) ),
+      meter_( "volume" )
+{
+    meter_.queue = boost::bind( &volume::queued, this );
+    con_ = sig_.connect( handler );
+}
+
+//
+volume::~volume()
+{
+    if ( run_ )
+        stop();
+
+    close();
+    con_.disconnect();
+}
+
+//
+void volume::add_directory( std::string dir, volume::filter match /*= volume::filter()*/ )
+{
+    boost::mutex::scoped_lock lock( mutex_ );
+
+    if ( ! boost::filesystem::is_directory( dir ) )
+        throw std::invalid_argument( "volume::add_directory: " + dir + " is not a valid directory entry" );
+
+    // events come with resolved (canonical) paths
+    query              q( boost::filesystem::canonical( dir ).string() );
+    queryset::iterator i = query_.find( q );
+
+    // filters accumulate on a directory
+    if ( i != query_.end() )
+        q = (*i);
+
+    q.add( match );
+
+    if ( ! q.meter )
+        q.meter = meter_.add( q.path );
+
+    query_.erase( q );
+    query_.insert( q );
+
+    // already running, mark right away
+    if ( fd_ != INVALID_HANDLE )
+        add_mark( q.path, q.mask );
+}
+
+//
+void volume::del_directory( std::string dir )
+{
+    boost::mutex::scoped_lock lock( mutex_ );
+
+    std::string path = boost::filesystem::weakly_canonical( dir ).string();
+
+    // the mark stays, events for the directory find no query
+    query_.erase( query( path ) );
+    meter_.del( path );
+}
+
+//
+void volume::del_directory( std::string dir, std::string name )
+{
+    boost::mutex::scoped_lock lock( mutex_ );
+
+    queryset::iterator i = query_.find( query( boost::filesystem::weakly_canonical( dir ).string() ) );
+
+    if ( i == query_.end() )
+        return;
+
+    query q = (*i);
+
+    if ( ! q.del( name ) )
+        return;
+
+    query_.erase( i );
+
+    if ( q.match.size() > 0 )
+        query_.insert( q );
+    else
+        meter_.del( q.path );
+}
+
+//
+void volume::start()
+{
+    if ( ! connected() )
+        throw std::runtime_error( "Signal slot not set" );
+
+    //
+    init();
+
+    {
+        boost::mutex::scoped_lock lock( mutex_ );
+
+        for ( queryset::iterator q = query_.begin(); q != query_.end(); ++q )
+            add_mark( (*q).path, (*q).mask );
+    }
+
+    //
+    run_ = true;
+
+    send_.start();
+
+    pool_.create_thread( boost::bind( &volume::work, this ) );
+}
+
+//
+void volume::stop()
+{
+    run_ = false;
+
+    wake();
+    interrupt();
+    join();
+    close();
+
+    // what the reader queued still goes out
+    send_.stop();
+}
+
+//
+volume::connection volume::connect( const volume::slot_t& handler )
+{
+    return ( con_ = sig_.connect( handler ) );
+}
+
+//
+void volume::interrupt()
+{
+    pool_.interrupt_all();
+    wake();
+}
+
+//
+void volume::join()
+{
+    pool_.join_all();
+}
+
+//
+void volume::init()
+{
+    boost::mutex::scoped_lock lock( mutex_ );
+
+    struct epoll_event ev;
+    unsigned int       flags = FAN_CLASS_NOTIF | FAN_REPORT_DFID_NAME | FAN_NONBLOCK | FAN_CLOEXEC;
+
+    if ( fd_ != INVALID_HANDLE )
+        return;
+
+    if ( opt_.unlimited )
+        flags |= FAN_UNLIMITED_QUEUE;
+
+    size_ = ( opt_.buffer > 0 ) ? std::max( opt_.buffer, (size_t)VOLUME_EVENT ) : VOLUME_BUFFER;
+    buff_.reset( new char[ size_ ] );
+
+    if ( ( fd_ = ::fanotify_init( flags, O_RDONLY | O_LARGEFILE | O_CLOEXEC ) ) == INVALID_HANDLE )
+        throw std::runtime_error( "Could not initialise fanotify (CAP_SYS_ADMIN, kernel 5.9 or later)" );
+
+    if ( ( ep_ = ::epoll_create1( EPOLL_CLOEXEC ) ) == INVALID_HANDLE )
+        throw std::runtime_error( "Invalid epoll file destriptor handle" );
+
+    if ( ( ev_ = ::eventfd( 0, EFD_NONBLOCK | EFD_CLOEXEC ) ) == INVALID_HANDLE )
+        throw std::runtime_error( "Invalid event file destriptor handle" );
+
+    memset( &ev, 0, sizeof( ev ) );
+    ev.events = EPOLLIN;
+
+    ev.data.fd = fd_;
+    if ( ::epoll_ctl( ep_, EPOLL_CTL_ADD, fd_, &ev ) < 0 )
+        throw std::runtime_error( "Could not add notification descriptor to epoll" );
+
+    ev.data.fd = ev_;
+    if ( ::epoll_ctl( ep_, EPOLL_CTL_ADD, ev_, &ev ) < 0 )
+        throw std::runtime_error( "Could not add event descriptor to epoll" );
+}
+
+//
+void volume::wake()
+{
+    boost::mutex::scoped_lock lock( mutex_ );
+
+    uint64_t val = 1;
+
+    if ( ev_ != INVALID_HANDLE )
+    {
+        if ( ::write( ev_, &val, sizeof( val ) ) < 0 )
+            return;
+    }
+}
+
+//
+void volume::close()
+{
+    boost::mutex::scoped_lock lock( mutex_ );
+
+    // closing the fanotify descriptor releases all of its marks
+    if ( fd_ != INVALID_HANDLE ) ::close( fd_ );
+    if ( ep_ != INVALID_HANDLE ) ::close( ep_ );
+    if ( ev_ != INVALID_HANDLE ) ::close( ev_ );
+
+    for ( marks::iterator m = mark_.begin(); m != mark_.end(); ++m )
+        ::close( m->second.root );
+
+    fd_ = ep_ = ev_ = INVALID_HANDLE;
+
+    mark_.clear();
+    path_.clear();
+    held_.clear();
+}
+
+//
+// Mark the filesystem (or mount) holding the directory, once per filesystem
+// and again only when the mask widens. Called with mutex_ held.
+//
+void volume::add_mark( std::string const& path, uint32_t mask )
+{
+    std::string        id = fsid( path );
+    marks::iterator    m  = mark_.find( id );
+    uint32_t           k  = kernel( mask );
+    unsigned int       how = FAN_MARK_ADD | ( ( opt_.mount ) ? FAN_MARK_MOUNT : FAN_MARK_FILESYSTEM );
+
+    if ( ( m != mark_.end() ) && ( ( m->second.mask & k ) == k ) )
+        return;
+
+    while ( ::fanotify_mark( fd_, how, k, AT_FDCWD, path.c_str() ) < 0 )
+    {
+        if ( ( errno != EINVAL ) || ( move_ == FAN_MOVE ) || ( opt_.mount ) )
+            throw std::runtime_error( "Could not mark the filesystem of " + path );
+
+        move_ = FAN_MOVE;
+        k     = kernel( mask );
+    }
+
+    if ( m == mark_.end() )
+    {
+        mark n;
+
+        if ( ( n.root = ::open( path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC ) ) == INVALID_HANDLE )
+            throw std::runtime_error( "Could not open " + path );
+
+        n.path = path;
+        m      = mark_.insert( std::make_pair( id, n ) ).first;
+    }
+
+    m->second.mask |= k;
+}
+
+//
+// The filters' events as fanotify takes them. Moves are always asked for,
+// a directory renamed makes the cached paths below it wrong.
+//
+uint32_t volume::kernel( uint32_t mask ) const
+{
+    uint32_t k = mask & ( IN_ALL_EVENTS & ~IN_MOVE );
+
+    if ( opt_.mount )
+        return ( k & VOLUME_MOUNT ) | FAN_ONDIR;
+
+    return k | move_ | FAN_ONDIR;
+}
+
+//
+void volume::work()
+{
+    try
+    {
+        struct epoll_event ev[ VOLUME_EPOLL ];
+
+        while ( run_ )
+        {
+            int n = ::epoll_wait( ep_, ev, VOLUME_EPOLL, -1 );
+
+            if ( n < 0 )
+            {
+                if ( errno == EINTR )
+                    continue;
+
+                throw std::runtime_error( "Could not wait on volume monitor" );
+            }
+
+            //
+            boost::this_thread::interruption_point();
+
+            for ( int e = 0; ( e < n ) && ( run_ ); ++e )
+            {
+                if ( ev[ e ].data.fd == fd_ )
+                    read();
+                else
+                {
+                    uint64_t val;
+
+                    // drain the wake-up counter, run_ is checked by the loop
+                    if ( ::read( ev_, &val, sizeof( val ) ) < 0 )
+                        continue;
+                }
+            }
+
+            //
+            flush();
+        }
+    }
+    catch ( boost::thread_interrupted const& )
+    {
+        // interuption is expected, so do nothing
+    }
+}
+
+//
+// Drain the descriptor. Each event carries the handle of its directory and
+// the name in it (two of each for a rename), resolved here to full paths.
+//
+void volume::read()
+{
+    ssize_t len;
+
+    while ( run_ )
+    {
+        if ( ( len = ::read( fd_, buff_.get(), size_ ) ) < 0 )
+        {
+            if ( errno == EINTR )
+                continue;
+
+            break;
+        }
+
+        if ( len == 0 )
+            break;
+
+        meter_.read( len );
+
+        boost::mutex::scoped_lock lock( mutex_ );
+
+        struct fanotify_event_metadata* meta = (struct fanotify_event_metadata*)buff_.get();
+
+        for ( ; ( FAN_EVENT_OK( meta, len ) ) && ( run_ ); meta = FAN_EVENT_NEXT( meta, len ) )
+        {
+            if ( meta->vers != FANOTIFY_METADATA_VERSION )
+                throw std::runtime_error( "Unexpected fanotify metadata version" );
+
+            if ( meta->fd >= 0 )
+                ::close( meta->fd );
+
+            // the queue was full and events were dropped
+            if ( meta->mask & FAN_Q_OVERFLOW )
+            {
+                metrics::count( meter_.all.overflows );
+                continue;
+            }
+
+            std::string path;
+            std::string from;
+            const char* info = (const char*)meta + meta->metadata_len;
+            const char* end  = (const char*)meta + meta->event_len;
+
+            while ( info < end )
+            {
+                struct fanotify_event_info_fid* fid = (struct fanotify_event_info_fid*)info;
+                struct file_handle*             fh  = (struct file_handle*)fid->handle;
+                std::string                     dir;
+
+                info += fid->hdr.len;
+
+                if ( fid->hdr.len == 0 )
+                    break;
+
+                if ( ( fid->hdr.info_type != FAN_EVENT_INFO_TYPE_DFID_NAME )
+#ifdef  FAN_RENAME
+                  && ( fid->hdr.info_type != FAN_EVENT_INFO_TYPE_OLD_DFID_NAME )
+                  && ( fid->hdr.info_type != FAN_EVENT_INFO_TYPE_NEW_DFID_NAME )
+#endif
+                   )
+                    continue;
+
+                if ( ! resolve( (const char*)&fid->fsid, fh, dir ) )
+                    continue;
+
+                const char* name = (const char*)( fh->f_handle + fh->handle_bytes );
+                std::string full = ( ::strcmp( name, "." ) == 0 ) ? dir : ( dir == "/" ) ? dir + name : dir + "/" + name;
+
+#ifdef  FAN_RENAME
+                if ( fid->hdr.info_type == FAN_EVENT_INFO_TYPE_OLD_DFID_NAME )
+                    from = full;
+                else
+#endif
+                    path = full;
+            }
+
+            // what was cached below a renamed directory is stale now
+            if ( ( meta->mask & FAN_ONDIR ) && ( meta->mask & move_ ) )
+                path_.clear();
+
+            if ( ( ! path.empty() ) || ( ! from.empty() ) )
+                event( (uint32_t)meta->mask, path, from );
+        }
+    }
+}
+
+//
+// One event for every query it concerns. A rename within a query is sent as
+// one renamed message, into it as created and out of it as deleted, like
+// the monitor does. Called with mutex_ held.
+//
+void volume::event( uint32_t mask, std::string const& path, std::string const& from )
+{
+#ifdef  FAN_RENAME
+    bool rename = ( mask & FAN_RENAME );
+
+    mask &= ~FAN_RENAME;
+#else
+    bool rename = false;
+#endif
+
+    for ( queryset::iterator q = query_.begin(); q != query_.end(); ++q )
+    {
+        bool        to   = ( ! path.empty() ) && ( within( path, (*q).path ) );
+        bool        away = ( ! from.empty() ) && ( within( from, (*q).path ) );
+        uint32_t    m    = mask;
+        std::string name = path;
+        std::string old;
+
+        if ( rename )
+        {
+            if ( ( to ) && ( away ) )
+            {
+                m   |= IN_MOVE;
+                old  = from;
+            }
+            else if ( to )
+                m |= IN_CREATE;
+            else if ( away )
+            {
+                m   |= IN_DELETE;
+                name = from;
+            }
+            else
+                continue;
+        }
+        else if ( ! to )
+            continue;
+
+        // below the query's directory only recursive filters count
+        bool             nested = ( name.length() > (*q).path.length() ) &&
+                                  ( name.rfind( '/' ) > ( ( (*q).path == "/" ) ? 0 : (*q).path.length() ) );
+        record           r;
+        bool             ok   = false;
+        bool             meta = false;
+        metrics::meter*  mt   = (*q).meter.get();
+
+        if ( mt )
+            metrics::count( mt->events );
+
+        if ( ( (*q).expr ) && ( (*q).expr->matches( name, state_ ) ) )
+        {
+            for ( size_t i = 0; i < (*q).match.size(); ++i )
+            {
+                if ( ( state_.hit( i ) ) && ( ( ! nested ) || ( (*q).match[ i ].recur ) ) && ( m & (*q).match[ i ].event ) )
+                {
+                    if ( ! ok )
+                        r.match = (uint32_t)i;
+
+                    r.event = (events)( r.event | ( m & (*q).match[ i ].event ) );
+                    meta   |= (*q).match[ i ].meta;
+                    ok      = true;
+                }
+            }
+        }
+
+        // only asked for metadata is read, gone by now is only expected of
+        // a deleted name
+        if ( ( ok ) && ( meta ) && ( ! ( r.event & ( IN_DELETE | IN_MOVED_FROM ) ) ) )
+        {
+            struct stat buf;
+
+            if ( mt )
+                metrics::count( mt->stats );
+
+            if ( ( ok = ( ::lstat( name.c_str(), &buf ) == 0 ) ) )
+            {
+                r.ino   = buf.st_ino;
+                r.size  = buf.st_size;
+                r.mtime = buf.st_mtim;
+            }
+        }
+
+        if ( mt )
+            metrics::count( ok ? mt->matched : mt->dropped );
+
+        if ( ok )
+            keep( *q, name, r, old );
+    }
+}
+
+//
+// Hold the message in its query's batch until the read is done, repeated
+// events for a name widen the one message. Called with mutex_ held.
+//
+void volume::keep( volume::query const& q, std::string const& name, volume::record& m, std::string const& from )
+{
+    hold& h = held_[ q.path ];
+
+    if ( ! h.msg )
+        h.msg.reset( new messages( q.match ) );
+
+    m.name = h.msg->intern( name );
+    m.from = h.msg->intern( from );
+
+    boost::unordered_map<uint32_t, size_t>::iterator a = h.at.find( m.name );
+
+    if ( a == h.at.end() )
+    {
+        h.at[ m.name ] = h.msg->size();
+        h.msg->push( m );
+
+        return;
+    }
+
+    record& r = h.msg->at( a->second );
+
+    r.event = (events)( r.event | m.event );
+    r.ino   = m.ino;
+    r.size  = m.size;
+    r.mtime = m.mtime;
+
+    if ( m.from != 0 )
+        r.from = m.from;
+}
+
+//
+// The path of a directory handle, from the cache or through the filesystem's
+// root descriptor. A directory deleted meanwhile cannot be resolved, its
+// events are dropped. Called with mutex_ held.
+//
+bool volume::resolve( const char* id, const void* fh, std::string& path )
+{
+    struct file_handle const* h   = (struct file_handle const*)fh;
+    std::string               key = std::string( id, sizeof( __kernel_fsid_t ) ) +
+                                    std::string( (const char*)fh, sizeof( struct file_handle ) + h->handle_bytes );
+    paths::iterator           p   = path_.find( key );
+
+    if ( p != path_.end() )
+    {
+        path = p->second;
+        return true;
+    }
+
+    marks::iterator m = mark_.find( key.substr( 0, sizeof( __kernel_fsid_t ) ) );
+
+    if ( m == mark_.end() )
+        return false;
+
+    // open_by_handle_at() takes the handle non-const
+    std::vector<char> copy( key.begin() + sizeof( __kernel_fsid_t ), key.end() );
+    char              link[ 32 ];
+    char              buf[ PATH_MAX ];
+    HANDLE            fd;
+    ssize_t           n;
+
+    if ( ( fd = ::open_by_handle_at( m->second.root, (struct file_handle*)&copy[ 0 ], O_PATH | O_CLOEXEC ) ) < 0 )
+        return false;
+
+    ::snprintf( link, sizeof( link ), "/proc/self/fd/%d", fd );
+
+    n = ::readlink( link, buf, sizeof( buf ) - 1 );
+    ::close( fd );
+
+    if ( n <= 0 )
+        return false;
+
+    path.assign( buf, n );
+
+    if ( ( path.length() > 10 ) && ( path.compare( path.length() - 10, 10, " (deleted)" ) == 0 ) )
+        return false;
+
+    // bounded, and cheap to refill
+    if ( path_.size() >= opt_.cache )
+        path_.clear();
+
+    path_[ key ] = path;
+
+    return true;
+}
+
+//
+void volume::flush()
+{
+    holding held;
+
+    {
+        boost::mutex::scoped_lock lock( mutex_ );
+        held.swap( held_ );
+    }
+
+    for ( holding::iterator h = held.begin(); h != held.end(); ++h )
+    {
+        h->second.msg->seal( opt_.order );
+
+        if ( connected() )
+            send_.push( messages_ptr( h->second.msg ) );
+    }
+}
+
+//
+void volume::deliver( volume::messages_ptr const& msg )
+{
+    uint64_t began = metrics::clock();
+
+    sig_( msg );
+    meter_.emitted( metrics::clock() - began );
+}
+
+//
+bool volume::connected()
+{
+    return ( ! sig_.empty() );
+}
+
+}   // namespace mti::audit::shield::directory
+
+}}} // namespace mti::audit::shield
@@ -0,0 +1,205 @@
+//
+// vol.hpp
+// ~~~~~~~~~~~~~~~~~~~~~
+//
+// Copyright (c) 2004-2012 Metasystems Technologies Inc. (MTI)
+// All rights reserved
+//
+// Distributed under the MTI Software License, Version 0.1.
+//
+// as defined by accompanying file MTI-LICENSE-0.1.info or
+// at http://www.mtihq.com/license/MTI-LICENSE-0.1.info
+//
+
+#ifndef __VOL_HPP
+#define __VOL_HPP
+
+// c
+#include <stdint.h>
+#include <sys/types.h>
+
+// c++
+#include <map>
+#include <string>
+
+// boost
+#include <boost/thread.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/shared_array.hpp>
+#include <boost/unordered_map.hpp>
+
+// local
+#include "dir.hpp"
+
+//
+namespace mti { namespace audit { namespace shield {
+
+//
+namespace directory {
+
+//
+// The "volume" class - which signals based on filesystem wide events
+//
+// A monitor for whole volumes: a single fanotify mark on the filesystem (or
+// mount) holding each directory replaces the per-directory inotify watches,
+// so adding a directory costs the same whatever the size of the tree below
+// it. Events name their directory by file handle, resolved to a path when
+// first seen and kept in a bounded cache; a directory renamed empties it.
+//
+// Filters, messages and slots are the monitor's, a handler serves either.
+// Needs CAP_SYS_ADMIN, and a kernel of 5.9 or later (FAN_REPORT_DFID_NAME).
+//
+class volume
+{
+    public:
+        //
+        typedef monitor::connection   connection;
+        typedef monitor::events       events;
+        typedef monitor::filter       filter;
+        typedef monitor::filters      filters;
+        typedef monitor::query        query;
+        typedef monitor::queryset     queryset;
+        typedef monitor::record       record;
+        typedef monitor::message      message;
+        typedef monitor::messages     messages;
+        typedef monitor::messages_ptr messages_ptr;
+        typedef monitor::signal_t     signal_t;
+        typedef monitor::slot_t       slot_t;
+
+        //
+        struct options
+        {
+            options() : buffer( 0 ), order( true ), mount( false ), cache( 65536 ), unlimited( false ) {}
+            options( size_t b ) : buffer( b ), order( true ), mount( false ), cache( 65536 ), unlimited( false ) {}
+            options( size_t b, bool o ) : buffer( b ), order( o ), mount( false ), cache( 65536 ), unlimited( false ) {}
+            options( size_t b, bool o, bool m ) : buffer( b ), order( o ), mount( m ), cache( 65536 ), unlimited( false ) {}
+
+            size_t buffer;      // fanotify read buffer in bytes, 0 = default
+            bool   order;       // batches sorted by name, one message per name
+            bool   mount;       // mark the mount rather than the filesystem
+            size_t cache;       // directory paths kept by file handle
+            bool   unlimited;   // no kernel queue limit (FAN_UNLIMITED_QUEUE)
+
+            dispatch::options queue;    // between the reader and the slots
+
+            options& operator=( options const& o )
+            {
+                buffer    = o.buffer;
+                order     = o.order;
+                mount     = o.mount;
+                cache     = o.cache;
+                unlimited = o.unlimited;
+                queue     = o.queue;
+
+                return *this;
+            }
+        };
+
+        //
+        volume( options opt = options() );
+        volume( const slot_t& handler, options opt = options() );
+        virtual ~volume();
+
+        //
+        void add_directory( std::string dir, filter match = filter() );
+        void del_directory( std::string dir );
+        void del_directory( std::string dir, std::string name );
+
+        //
+        void start();
+        void stop();
+
+        //
+        void interrupt();
+        void join();
+
+        //
+        connection connect( const slot_t& handler );
+
+        // kernel queue overflows seen, events were lost each time
+        uint64_t overflows() const { return meter_.all.overflows.load(); }
+
+        // the dispatch queue to the slots
+        dispatch::counters queued() const { return send_.stats(); }
+
+        // counters per query and overall, to read or export
+        metrics& meters() { return meter_; }
+
+    protected:
+    private:
+        //
+        // One marked filesystem, handles are opened relative to root
+        //
+        struct mark
+        {
+            mark() : root( -1 ), mask( NONE ) {}
+
+            HANDLE      root;   // a directory on it, for open_by_handle_at()
+            uint32_t    mask;   // marked with
+            std::string path;   // the directory that was marked
+        };
+
+        //
+        typedef std::map<std::string, mark> marks;     // fsid (raw bytes) -> mark
+
+        //
+        // Messages of one read, one batch per query
+        //
+        struct hold
+        {
+            boost::shared_ptr<messages>            msg;
+            boost::unordered_map<uint32_t, size_t> at;      // name -> record
+        };
+
+        //
+        typedef std::map<std::string, hold>                       holding;
+        typedef boost::unordered_map<std::string, std::string>    paths;    // fsid + handle -> directory
+
+        //
+        void init();
+        void wake();
+        void close();
+        void add_mark( std::string const& path, uint32_t mask );
+        uint32_t kernel( uint32_t mask ) const;
+        void work();
+        void read();
+        void event( uint32_t mask, std::string const& path, std::string const& from );
+        void keep( query const& q, std::string const& name, record& m, std::string const& from );
+        bool resolve( const char* fsid, const void* fh, std::string& path );
+        void flush();
+        void deliver( messages_ptr const& msg );
+        bool connected();
+
+        //
+        volatile bool       run_;
+        boost::mutex        mutex_;
+        options             opt_;
+        HANDLE              fd_;        // fanotify
+        HANDLE              ep_;        // epoll
+        HANDLE              ev_;        // eventfd, wakes the thread on stop()
+        boost::shared_array<char>
+                            buff_;
+        size_t              size_;
+        uint32_t            move_;      // VOLUME_MOVE, or FAN_MOVE where the kernel has no FAN_RENAME
+        marks               mark_;
+        paths               path_;      // resolved directories
+        queryset            query_;
+        matchset::state     state_;
+        holding             held_;
+        boost::thread_group pool_;
+
+        //
+        signal_t            sig_;
+        connection          con_;
+        dispatcher<messages_ptr, boost::shared_ptr<messages> >
+                            send_;
+
+        //
+        metrics             meter_;    // destroyed first, its socket thread reads send_
+};
+
+}   // namespace mti::audit::shield::directory
+
+}}} // namespace mti::audit::shield
+
+#endif // __VOL_HPP
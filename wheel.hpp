@@ -0,0 +1,147 @@
+//
+// wheel.hpp
+// ~~~~~~~~~~~~~~~~~~~~~
+//
+// Copyright (c) 2004-2012 Metasystems Technologies Inc. (MTI)
+// All rights reserved
+//
+// Distributed under the MTI Software License, Version 0.1.
+//
+// as defined by accompanying file MTI-LICENSE-0.1.info or
+// at http://www.mtihq.com/license/MTI-LICENSE-0.1.info
+//
+
+#ifndef __WHEEL_HPP
+#define __WHEEL_HPP
+
+// c
+#include <stdint.h>
+
+// c++
+#include <vector>
+#include <utility>
+#include <algorithm>
+
+// boost
+
+// local
+
+//
+namespace mti { namespace audit { namespace shield {
+
+//
+namespace directory {
+
+//
+// A hashed timer wheel, any number of timers for the price of one slot per
+// tick. A timer lands in the slot of its due tick (modulo the slots), and
+// expire() visits only the slots of the ticks passed since the last call,
+// handing out the timers that are due and leaving those a round or more
+// ahead where they are. Times are milliseconds of whatever monotonic clock
+// the caller uses; a timer cannot be cancelled, the owner ignores it when
+// it fires instead. The first expire() catches up with the clock.
+//
+template <class T>
+class wheel
+{
+    public:
+        //
+        wheel( size_t tick = 1, size_t slots = 256 )
+            : slot_( std::max( slots, (size_t)1 ) ),
+              tick_( std::max( tick, (size_t)1 ) ),
+              at_( 0 ),
+              size_( 0 )
+        {}
+
+        //
+        void add( uint64_t due, T const& t )
+        {
+            uint64_t n = ( due + tick_ - 1 ) / tick_;     // first tick not before due
+
+            // already passed, fires with the next tick
+            if ( n <= at_ )
+                n = at_ + 1;
+
+            slot_[ n % slot_.size() ].push_back( std::make_pair( due, t ) );
+            ++size_;
+        }
+
+        //
+        void expire( uint64_t now, std::vector<T>& out )
+        {
+            uint64_t end = now / tick_;
+            uint64_t n   = std::min( end - std::min( end, at_ ), (uint64_t)slot_.size() );
+
+            for ( uint64_t i = 1; i <= n; ++i )
+            {
+                timers& s = slot_[ ( at_ + i ) % slot_.size() ];
+
+                for ( size_t t = 0; t < s.size(); )
+                {
+                    if ( s[ t ].first > now )
+                    {
+                        ++t;
+                        continue;
+                    }
+
+                    out.push_back( s[ t ].second );
+
+                    s[ t ] = s.back();
+                    s.pop_back();
+                    --size_;
+                }
+            }
+
+            at_ = std::max( at_, end );
+        }
+
+        //
+        // milliseconds until the next tick worth waking for, -1 when empty.
+        // That is the first slot ahead holding a timer, or a full turn when
+        // every one left is a round or more away.
+        //
+        int next( uint64_t now ) const
+        {
+            if ( size_ == 0 )
+                return -1;
+
+            uint64_t n = 1;
+
+            while ( ( n < slot_.size() ) && ( slot_[ ( at_ + n ) % slot_.size() ].empty() ) )
+                ++n;
+
+            uint64_t due = ( at_ + n ) * tick_;
+
+            return ( due > now ) ? (int)( due - now ) : 0;
+        }
+
+        //
+        size_t size() const { return size_; }
+
+        //
+        void clear()
+        {
+            for ( size_t i = 0; i < slot_.size(); ++i )
+                slot_[ i ].clear();
+
+            at_   = 0;
+            size_ = 0;
+        }
+
+    protected:
+    private:
+        //
+        typedef std::vector< std::pair<uint64_t, T> > timers;
+
+        //
+        std::vector<timers> slot_;
+        uint64_t            tick_;
+        uint64_t            at_;    // last tick expired
+        size_t              size_;
+};
+
+}   // namespace mti::audit::shield::directory
+
+}}} // namespace mti::audit::shield
+
+#endif // __WHEEL_HPP